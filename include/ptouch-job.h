@@ -0,0 +1,66 @@
+/*
+	ptouch-job - build labels in memory and print them in the background
+
+	Copyright (C) 2015 Dominic Radermacher <dominic.radermacher@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef PTOUCH_JOB_H
+#define PTOUCH_JOB_H
+
+#include "ptouch.h"
+#include "ptouch-render.h"
+
+/* --------------------------------------------------------------------
+	A job is one label made of segments that are placed one after the
+	other along the tape, like the print commands of ptouch-print:
+
+	ptouch_ctx ctx=ptouch_ctx_new();
+	ptouch_dev dev;
+	ptouch_job job;
+
+	ptouch_open(ctx, &dev);
+	ptouch_init(dev);
+	ptouch_getstatus(dev);
+	job=ptouch_job_new(ctx);
+	ptouch_job_add_text(job, "first line\nsecond line");
+	ptouch_job_add_cutmark(job);
+	ptouch_job_add_bitmap(job, logo, 64, 48, 8);
+	ptouch_job_submit(job, dev);	// renders, printing starts
+	...				// the caller may go on
+	r=ptouch_job_wait(job);		// 0 if the label was printed
+	ptouch_job_free(job);
+
+	A text segment has at most PT_JOB_MAX_LINES lines, for more
+	ptouch_job_add_text() fails with errno E2BIG.
+
+	ptouch_job_submit() renders the label for the tape in the printer
+	with the font settings of ctx, in the calling thread. Sending it
+	happens in a thread of its own. Until ptouch_job_wait() returned,
+	the device must not be used otherwise.
+   -------------------------------------------------------------------- */
+#define PT_JOB_MAX_LINES	4	/* lines per text segment */
+
+typedef struct _ptouch_job *ptouch_job;	/* opaque */
+
+ptouch_job ptouch_job_new(ptouch_ctx ctx);
+int ptouch_job_add_text(ptouch_job job, const char *text);
+int ptouch_job_add_bitmap(ptouch_job job, const uint8_t *data, int width, int height, int stride);
+int ptouch_job_add_cutmark(ptouch_job job);
+int ptouch_job_submit(ptouch_job job, ptouch_dev dev);
+int ptouch_job_wait(ptouch_job job);
+void ptouch_job_free(ptouch_job job);
+
+#endif
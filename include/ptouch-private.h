@@ -0,0 +1,79 @@
+/*
+	libptouch - the parts of libptouch that are not part of its ABI
+
+	Copyright (C) 2015 Dominic Radermacher <dominic.radermacher@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* --------------------------------------------------------------------
+	Only the library itself includes this header, it is not installed.
+	Programs see ptouch_ctx and ptouch_dev as opaque pointers and use
+	the accessor functions of ptouch.h, so the structs below can change
+	without breaking them.
+   -------------------------------------------------------------------- */
+#ifndef PTOUCH_PRIVATE_H
+#define PTOUCH_PRIVATE_H
+
+#include <pthread.h>
+#include <libusb-1.0/libusb.h>
+#include "ptouch.h"
+
+/* --------------------------------------------------------------------
+	Label bitmaps and command buffers taken with pt_label_get() and
+	ptouch_buf_get() go back to the pool of their context when they
+	are freed, and are handed out again with the memory they had. So
+	after the first few labels, the bitmaps and command buffers of a
+	label of about the same size need no new memory. misses counts the
+	malloc() and realloc() calls for pooled objects, i.e. how often the
+	pool had nothing big enough. Everything else, like jobs, segments
+	or the scratch memory for scaling images, is still allocated per
+	label and not counted.
+   -------------------------------------------------------------------- */
+struct _ptouch_pool {
+	struct _pt_label *labels;	/* free labels, see ptouch-render.h */
+	struct _ptouch_buf *bufs;	/* free command buffers */
+	uint64_t misses;
+};
+
+struct _ptouch_ctx {
+	libusb_context *usb;		/* NULL until the first ptouch_open() */
+	libusb_device **devs;		/* device list of the last ptouch_open() */
+	pthread_mutex_t lock;		/* protects usb, devs and pool */
+	char *font;			/* font file or fontconfig name */
+	int fontsize;			/* 0 to fit the text to the tape */
+	int verbose;
+	void *render;			/* font caches, see ptouch-render.c */
+	void (*render_free)(void *render);
+	struct _ptouch_pool pool;
+};
+
+struct _ptouch_dev {
+	ptouch_ctx ctx;
+	libusb_device_handle *h;
+	int fd;			/* usblp device or output file when not using libusb */
+	int lp;			/* the status can be read from fd */
+	uint8_t raw[32];
+	uint8_t tape_width_mm;
+	uint8_t tape_width_px;
+	uint8_t status;
+	uint8_t media_type;
+	pt_dev_info devinfo;
+	struct _ptouch_pack pack;	/* kernel for the tape width */
+	struct _ptouch_stats stats;
+};
+
+void ptouch_pool_count(ptouch_ctx ctx);
+
+#endif
@@ -0,0 +1,86 @@
+/*
+	ptouch-render - render labels directly into printer raster lines
+
+	Copyright (C) 2015 Dominic Radermacher <dominic.radermacher@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef PTOUCH_RENDER_H
+#define PTOUCH_RENDER_H
+
+#include <stdint.h>
+#include "ptouch.h"
+
+#define PT_RASTER_BYTES	16	/* bytes per raster line (128px print head) */
+#define PT_RASTER_PX	(8*PT_RASTER_BYTES)
+
+/* A label is kept in the same layout the printer wants it: one raster
+   line of PT_RASTER_BYTES per column, so printing it means just sending
+   the columns. Row 0 is the top edge of the label, the label is centered
+   on the print head like print_img() always did. */
+struct _pt_label {
+	int width;		/* length of the label in columns */
+	int height;		/* printable height in px */
+	int offset;		/* print head pixel of the bottom row */
+	struct _ptouch_pack pack;	/* kernel for columns of height px */
+	int alloc;		/* number of columns allocated */
+	uint8_t *raster;	/* width * PT_RASTER_BYTES bytes */
+	ptouch_ctx ctx;		/* pool it goes back to, or NULL */
+	struct _pt_label *next;	/* in the pool */
+};
+typedef struct _pt_label *pt_label;
+
+#define pt_label_column(l, x)	((l)->raster+(x)*PT_RASTER_BYTES)
+
+pt_label pt_label_new(int height, int width);
+pt_label pt_label_get(ptouch_ctx ctx, int height, int width);
+void pt_label_free(pt_label l);
+int pt_label_resize(pt_label l, int width);
+void pt_label_setpixel(pt_label l, int x, int y);
+int pt_label_getpixel(pt_label l, int x, int y);
+int pt_label_append(pt_label l, pt_label src);
+int pt_label_merge(pt_label l, pt_label src);
+int pt_label_cutmark(pt_label l);
+
+/* text functions use the font caches of ctx, see ptouch.h */
+int pt_text_extent(ptouch_ctx ctx, const char *font, int size, const char *text, int *width, int *ascent, int *descent);
+int pt_text_draw(ptouch_ctx ctx, pt_label l, const char *font, int size, int x, int baseline, const char *text);
+int pt_text_fit(ptouch_ctx ctx, const char *font, const char *text, int want_px);
+pt_label pt_render_line(ptouch_ctx ctx, const char *font, int size, const char *text, int tape_width, int n, int lines);
+pt_label pt_render_text(ptouch_ctx ctx, const char *font, int *size, char *line[], int lines, int tape_width);
+pt_label pt_render_text_len(ptouch_ctx ctx, const char *font, int *size, char *line[], int lines, int tape_width, int max_width);
+void pt_font_cleanup(ptouch_ctx ctx);
+
+/* built-in bitmap fonts, used for font names "builtin:<name>". For
+   them the font size is the scale, each font pixel is size x size px */
+#define PT_BITFONT_PREFIX	"builtin:"
+struct _pt_bitfont {
+	const char *name;
+	int width;		/* columns of a character */
+	int height;		/* rows of a character, all above the baseline */
+	int bold;		/* extra columns, bold fonts draw each glyph
+				   column twice */
+	int smooth;		/* glyph is scaled up 2x with Scale2x */
+	int first, last;	/* characters in glyph */
+	const uint8_t *glyph;	/* columns per character, bit 0 on top */
+};
+
+const struct _pt_bitfont *pt_bitfont_find(const char *name);
+uint16_t pt_bitfont_column(const struct _pt_bitfont *f, unsigned long ch, int c);
+
+int pt_barcode_code128(pt_label l, const char *data);
+int pt_barcode_qr(pt_label l, const char *data);
+
+#endif
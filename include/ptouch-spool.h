@@ -0,0 +1,64 @@
+/*
+	ptouch-spool - crash safe on disk queue of print jobs
+
+	Copyright (C) 2015 Dominic Radermacher <dominic.radermacher@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef PTOUCH_SPOOL_H
+#define PTOUCH_SPOOL_H
+
+#include <sys/types.h>	/* off_t */
+
+/* The spool is one append-only file, each job is a record header
+   followed by the printer commands of the job:
+
+	offset	size
+	0	2	magic "PJ"
+	2	1	state, one of SPOOL_QUEUED, SPOOL_SENDING, SPOOL_DONE
+	3	1	tape width in px the job was rendered for
+	4	4	length of the data, little endian
+	8	4	FNV-1a hash of the data, little endian
+	12	4	raster lines in the data, little endian
+	16	4	labels in the data, little endian
+	20	len	printer commands
+
+   Only the state byte is ever rewritten. A record that is cut short
+   or has a wrong hash was not completely written and ends the spool. */
+#define SPOOL_HEADER	20
+#define SPOOL_QUEUED	'q'
+#define SPOOL_SENDING	's'
+#define SPOOL_DONE	'd'
+
+struct _pt_spool {
+	int fd;
+	off_t end;		/* where the next record goes */
+	off_t next;		/* first record not done yet */
+	off_t sent;		/* end of the records pt_spool_run() sent */
+	int jobs;		/* records in the spool */
+	int pending;		/* records not done yet */
+	int unsynced;		/* records added since the last fsync */
+	ptouch_buf wbuf;	/* records not written yet */
+};
+typedef struct _pt_spool *pt_spool;
+
+pt_spool pt_spool_open(const char *dir);
+int pt_spool_add(pt_spool s, ptouch_buf b, int tape_width);
+int pt_spool_sync(pt_spool s);
+int pt_spool_run(pt_spool s, ptouch_dev ptdev);
+int pt_spool_done(pt_spool s);
+void pt_spool_close(pt_spool s, int ok);
+
+#endif
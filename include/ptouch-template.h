@@ -0,0 +1,57 @@
+/*
+	ptouch-template - labels with static content and variable fields
+
+	Copyright (C) 2015 Dominic Radermacher <dominic.radermacher@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef PTOUCH_TEMPLATE_H
+#define PTOUCH_TEMPLATE_H
+
+#define TEMPLATE_VALUE_LEN	256
+
+struct _pt_field {
+	int x;			/* first column */
+	int width;		/* columns reserved for the field */
+	int baseline;		/* label row of the font baseline */
+	int size;		/* font size */
+	char *format;		/* text with {counter}, {date} or {1}..{9} */
+	char value[TEMPLATE_VALUE_LEN];	/* currently rendered text */
+	pt_label img;		/* currently rendered field, width columns */
+};
+
+/* A template is rendered once into a background label and encoded into
+   raster commands. For each label only the fields whose text changed
+   are rendered again, and only their columns are encoded again. */
+struct _pt_template {
+	ptouch_ctx ctx;		/* for the font caches */
+	char *font;
+	pt_label bg;		/* static content */
+	pt_label label;		/* background plus fields */
+	ptouch_buf buf;		/* label as raster commands */
+	struct _pt_field *field;
+	int fields;
+	long counter;		/* counter of the next label */
+	long step;
+	int digits;
+	int rendered;		/* number of labels rendered so far */
+};
+typedef struct _pt_template *pt_template;
+
+pt_template pt_template_load(ptouch_ctx ctx, const char *file, int tape_width);
+int pt_template_next(pt_template t, char *data[], int cols);
+void pt_template_free(pt_template t);
+
+#endif
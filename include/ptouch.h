@@ -17,8 +17,11 @@
 	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
+#ifndef PTOUCH_H
+#define PTOUCH_H
+
 #include <stdint.h>
-#include <libusb-1.0/libusb.h>
+#include <stddef.h>
 
 struct _pt_tape_info {
 	uint8_t mm;		/* Tape width in mm */
@@ -34,18 +37,78 @@ struct _pt_dev_info {
 };
 typedef struct _pt_dev_info *pt_dev_info;
 
-struct _ptouch_dev {
-	libusb_device_handle *h;
-	uint8_t raw[32];
-	uint8_t tape_width_mm;
-	uint8_t tape_width_px;
-	uint8_t status;
-	uint8_t media_type;
-	pt_dev_info devinfo;
+/* latency histogram, bucket[i] counts values <= ptouch_hist_le[i]
+   that did not fit into a smaller bucket */
+#define PT_HIST_BUCKETS	12
+extern const double ptouch_hist_le[PT_HIST_BUCKETS];
+struct _ptouch_hist {
+	uint64_t bucket[PT_HIST_BUCKETS];
+	uint64_t count;
+	double sum;		/* seconds */
+};
+
+/* counters since the device was opened */
+struct _ptouch_stats {
+	uint64_t labels;		/* labels sent */
+	uint64_t lines;			/* raster lines sent */
+	uint64_t bytes;			/* bytes sent */
+	uint64_t status_failed;		/* ptouch_getstatus() failures */
+	uint64_t unknown_tape;		/* status with unknown tape width */
+	uint64_t error[2][8];		/* set bits of status error 1 and 2 */
+	struct _ptouch_hist transfer;	/* ptouch_send() */
+	struct _ptouch_hist status;	/* ptouch_getstatus() */
 };
+
+/* --------------------------------------------------------------------
+	A context owns everything that used to be global: the libusb
+	context, the device list and the render settings and caches. There
+	is no global state, so any number of contexts can be used at once.
+
+	Thread safety: ptouch_open() may be called from several threads
+	with the same context. A ptouch_dev may be used by any thread, but
+	only by one thread at a time, different devices can be used at the
+	same time. Rendering text (ptouch-render.h) uses the font caches of
+	the context and must not be done by more than one thread at a time
+	per context, threads that render in parallel need a context each.
+	Pooled labels and buffers may be freed by any thread, but they have
+	to be freed before their context.
+
+	Contexts and devices are opaque, their settings and counters are
+	read and changed with the functions below.
+   -------------------------------------------------------------------- */
+typedef struct _ptouch_ctx *ptouch_ctx;
 typedef struct _ptouch_dev *ptouch_dev;
 
-int ptouch_open(ptouch_dev *ptdev);
+/* packs a column of height pixels, px[0] is the top one and nonzero
+   is black, into a raster line, see ptouch-pack.c */
+struct _ptouch_pack {
+	int height;
+	void (*column)(uint8_t *line, const uint8_t *px, int height);
+	uint8_t cutmark[16];	/* raster line of a cutmark */
+};
+
+/* printer commands, built once and sent as often as needed */
+struct _ptouch_buf {
+	uint8_t *data;
+	size_t len;
+	size_t alloc;
+	int lines;		/* raster lines in data */
+	int labels;		/* labels in data, set by the caller */
+	ptouch_ctx ctx;		/* pool it goes back to, or NULL */
+	struct _ptouch_buf *next;	/* in the pool */
+};
+typedef struct _ptouch_buf *ptouch_buf;
+
+ptouch_ctx ptouch_ctx_new(void);
+void ptouch_ctx_free(ptouch_ctx ctx);
+int ptouch_ctx_setfont(ptouch_ctx ctx, const char *font);
+const char *ptouch_ctx_font(ptouch_ctx ctx);
+void ptouch_ctx_setfontsize(ptouch_ctx ctx, int size);
+int ptouch_ctx_fontsize(ptouch_ctx ctx);
+uint64_t ptouch_pool_misses(ptouch_ctx ctx);
+int ptouch_open(ptouch_ctx ctx, ptouch_dev *ptdev);
+int ptouch_open_file(ptouch_ctx ctx, ptouch_dev *ptdev, const char *file, int tape_width_mm);
+int ptouch_open_lp(ptouch_ctx ctx, ptouch_dev *ptdev, const char *dev, int tape_width_mm);
 int ptouch_close(ptouch_dev ptdev);
 int ptouch_send(ptouch_dev ptdev, uint8_t *data, int len);
 int ptouch_init(ptouch_dev ptdev);
@@ -55,5 +118,18 @@ int ptouch_cutmark(ptouch_dev ptdev);
 int ptouch_eject(ptouch_dev ptdev);
 int ptouch_getstatus(ptouch_dev ptdev);
 int ptouch_getmaxwidth(ptouch_dev ptdev);
+int ptouch_gettapewidth(ptouch_dev ptdev);
+ptouch_ctx ptouch_dev_ctx(ptouch_dev ptdev);
+const struct _ptouch_stats *ptouch_getstats(ptouch_dev ptdev);
+int ptouch_tape_px(int tape_width_mm);
 int ptouch_rasterstart(ptouch_dev ptdev);
 int ptouch_sendraster(ptouch_dev ptdev, uint8_t *data, int len);
+ptouch_buf ptouch_buf_new(void);
+ptouch_buf ptouch_buf_get(ptouch_ctx ctx);
+void ptouch_buf_free(ptouch_buf b);
+int ptouch_buf_add(ptouch_buf b, const uint8_t *data, size_t len);
+int ptouch_buf_raster(ptouch_buf b, const uint8_t *data, int lines, int len);
+int ptouch_buf_send(ptouch_dev ptdev, ptouch_buf b);
+void ptouch_pack_init(struct _ptouch_pack *k, int height);
+
+#endif
@@ -23,10 +23,16 @@
 #include <sys/types.h>	/* open() */
 #include <sys/stat.h>	/* open() */
 #include <fcntl.h>	/* open() */
-#include <time.h>	/* nanosleep(), struct timespec */
+#include <unistd.h>	/* write(), read(), close() */
+#include <poll.h>	/* poll() */
+#include <sys/ioctl.h>	/* ioctl() */
+#include <errno.h>
+#include <time.h>	/* nanosleep(), clock_gettime() */
 #include "config.h"
 #include "gettext.h"	/* gettext(), ngettext() */
 #include "ptouch.h"
+#include "ptouch-render.h"	/* pt_label, for the pool */
+#include "ptouch-private.h"
 
 #define _(s) gettext(s)
 
@@ -44,34 +50,155 @@ struct _pt_dev_info ptdevs[] = {
 	{0,0,"",0,0}
 };
 
+const double ptouch_hist_le[PT_HIST_BUCKETS]= {
+	0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+	0.05, 0.1, 0.25, 0.5, 1, 2.5
+};
+
 void ptouch_rawstatus(uint8_t raw[32]);
+#define LP_DEVICES 16	/* /dev/usb/lp0 to lp15 */
+#define LP_TRIES 20	/* every 0.1s, while usblp binds to the printer */
+static int ptouch_lp_find(pt_dev_info *info, int tries);
+static int ptouch_lp_dev(ptouch_ctx ctx, ptouch_dev *ptdev, int fd, pt_dev_info info, int tape_width_mm);
 
-int ptouch_open(ptouch_dev *ptdev)
+static double ptouch_now(void)
 {
-	libusb_device **devs;
-	libusb_device *dev;
-	libusb_device_handle *handle = NULL;
-	struct libusb_device_descriptor desc;
-	ssize_t cnt;
-	int r,i=0;
-	
-	if ((*ptdev=malloc(sizeof(struct _ptouch_dev))) == NULL) {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec+t.tv_nsec/1e9;
+}
+
+static void ptouch_hist_add(struct _ptouch_hist *h, double v)
+{
+	for (int i=0; i<PT_HIST_BUCKETS; i++) {
+		if (v <= ptouch_hist_le[i]) {
+			h->bucket[i]++;
+			break;
+		}
+	}
+	h->count++;
+	h->sum+=v;
+}
+
+ptouch_ctx ptouch_ctx_new(void)
+{
+	ptouch_ctx ctx;
+
+	if ((ctx=malloc(sizeof(struct _ptouch_ctx))) == NULL) {
 		fprintf(stderr, _("out of memory\n"));
-		return -1;
+		return NULL;
 	}
-	if ((libusb_init(NULL)) < 0) {
-		fprintf(stderr, _("libusb_init() failed\n"));
-		return -1;
+	memset(ctx, 0, sizeof(struct _ptouch_ctx));
+	if ((ctx->font=strdup("DejaVuSans")) == NULL) {
+		free(ctx);
+		return NULL;
+	}
+	pthread_mutex_init(&ctx->lock, NULL);
+	return ctx;
+}
+
+/* all devices opened with ctx have to be closed before */
+void ptouch_ctx_free(ptouch_ctx ctx)
+{
+	struct _pt_label *l;
+	ptouch_buf b;
+
+	if (ctx == NULL) {
+		return;
 	}
-//	libusb_set_debug(NULL, 3);
-	if ((cnt=libusb_get_device_list(NULL, &devs)) < 0) {
+	while ((l=ctx->pool.labels) != NULL) {
+		ctx->pool.labels=l->next;
+		free(l->raster);
+		free(l);
+	}
+	while ((b=ctx->pool.bufs) != NULL) {
+		ctx->pool.bufs=b->next;
+		free(b->data);
+		free(b);
+	}
+	if (ctx->render_free != NULL) {
+		ctx->render_free(ctx->render);
+	}
+	if (ctx->devs != NULL) {
+		libusb_free_device_list(ctx->devs, 1);
+	}
+	if (ctx->usb != NULL) {
+		libusb_exit(ctx->usb);
+	}
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx->font);
+	free(ctx);
+}
+
+/* count an allocation made for a pooled object */
+void ptouch_pool_count(ptouch_ctx ctx)
+{
+	pthread_mutex_lock(&ctx->lock);
+	ctx->pool.misses++;
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+int ptouch_ctx_setfont(ptouch_ctx ctx, const char *font)
+{
+	char *p;
+
+	if ((p=strdup(font)) == NULL) {
 		return -1;
 	}
-	while ((dev=devs[i++]) != NULL) {
+	free(ctx->font);
+	ctx->font=p;
+	return 0;
+}
+
+const char *ptouch_ctx_font(ptouch_ctx ctx)
+{
+	return ctx->font;
+}
+
+/* 0 to fit the text to the tape */
+void ptouch_ctx_setfontsize(ptouch_ctx ctx, int size)
+{
+	ctx->fontsize=size;
+}
+
+int ptouch_ctx_fontsize(ptouch_ctx ctx)
+{
+	return ctx->fontsize;
+}
+
+/* allocations for pooled objects the pool could not serve */
+uint64_t ptouch_pool_misses(ptouch_ctx ctx)
+{
+	uint64_t n;
+
+	pthread_mutex_lock(&ctx->lock);
+	n=ctx->pool.misses;
+	pthread_mutex_unlock(&ctx->lock);
+	return n;
+}
+
+/* find the first supported printer in the device list of ctx and
+   open it, called with ctx->lock held */
+static libusb_device_handle *ptouch_find(ptouch_ctx ctx, pt_dev_info *info)
+{
+	libusb_device *dev;
+	libusb_device_handle *handle=NULL;
+	struct libusb_device_descriptor desc;
+	int r, i=0;
+
+	if (ctx->devs != NULL) {
+		libusb_free_device_list(ctx->devs, 1);
+		ctx->devs=NULL;
+	}
+	if (libusb_get_device_list(ctx->usb, &ctx->devs) < 0) {
+		ctx->devs=NULL;
+		return NULL;
+	}
+	while ((dev=ctx->devs[i++]) != NULL) {
 		if ((r=libusb_get_device_descriptor(dev, &desc)) < 0) {
 			fprintf(stderr, _("failed to get device descriptor"));
-			libusb_free_device_list(devs, 1);
-			return -1;
+			return NULL;
 		}
 		for (int k=0; ptdevs[k].vid > 0; k++) {
 			if ((desc.idVendor == ptdevs[k].vid) && (desc.idProduct == ptdevs[k].pid) && (ptdevs[k].flags >= 0)) {
@@ -81,50 +208,274 @@ int ptouch_open(ptouch_dev *ptdev)
 					libusb_get_device_address(dev));
 				if ((r=libusb_open(dev, &handle)) != 0) {
 					fprintf(stderr, _("libusb_open error :%s\n"), libusb_error_name(r));
-					return -1;
-				}
-				libusb_free_device_list(devs, 1);
-				if ((r=libusb_kernel_driver_active(handle, 0)) == 1) {
-					if ((r=libusb_detach_kernel_driver(handle, 0)) != 0) {
-						fprintf(stderr, _("error while detaching kernel driver: %s\n"), libusb_error_name(r));
-					}
+					return NULL;
 				}
-				if ((r=libusb_claim_interface(handle, 0)) != 0) {
-					fprintf(stderr, _("interface claim error: %s\n"), libusb_error_name(r));
-					return -1;
-				}
-				(*ptdev)->h=handle;
-				return 0;
+				*info=&ptdevs[k];
+				return handle;
 			}
 		}
 	}
 	fprintf(stderr, _("No P-Touch printer found on USB (remember to put switch to position E)\n"));
-	libusb_free_device_list(devs, 1);
+	return NULL;
+}
+
+int ptouch_open(ptouch_ctx ctx, ptouch_dev *ptdev)
+{
+	libusb_device_handle *handle;
+	pt_dev_info info=NULL;
+	int r, fd, detached=0;
+
+	*ptdev=NULL;
+	pthread_mutex_lock(&ctx->lock);
+	if ((ctx->usb == NULL) && (libusb_init(&ctx->usb) < 0)) {
+		fprintf(stderr, _("libusb_init() failed\n"));
+		ctx->usb=NULL;
+		pthread_mutex_unlock(&ctx->lock);
+		return ptouch_open_lp(ctx, ptdev, NULL, 0);
+	}
+//	libusb_set_debug(ctx->usb, 3);
+	handle=ptouch_find(ctx, &info);
+	pthread_mutex_unlock(&ctx->lock);
+	if (handle == NULL) {		/* maybe no permission, try usblp */
+		return ptouch_open_lp(ctx, ptdev, NULL, 0);
+	}
+	if ((r=libusb_kernel_driver_active(handle, 0)) == 1) {
+		if ((r=libusb_detach_kernel_driver(handle, 0)) != 0) {
+			fprintf(stderr, _("error while detaching kernel driver: %s\n"), libusb_error_name(r));
+		} else {
+			detached=1;
+		}
+	}
+	if ((r=libusb_claim_interface(handle, 0)) != 0) {
+		fprintf(stderr, _("interface claim error: %s\n"), libusb_error_name(r));
+		if (!detached) {
+			libusb_close(handle);
+			return ptouch_open_lp(ctx, ptdev, NULL, 0);
+		}
+		/* give the printer back to usblp, its device node shows up
+		   again after a moment */
+		if ((r=libusb_attach_kernel_driver(handle, 0)) != 0) {
+			fprintf(stderr, _("error while attaching kernel driver: %s\n"), libusb_error_name(r));
+		}
+		libusb_close(handle);
+		if ((fd=ptouch_lp_find(&info, LP_TRIES)) < 0) {
+			return -1;
+		}
+		return ptouch_lp_dev(ctx, ptdev, fd, info, 0);
+	}
+	if ((*ptdev=malloc(sizeof(struct _ptouch_dev))) == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		libusb_release_interface(handle, 0);
+		libusb_close(handle);
+		return -1;
+	}
+	memset(*ptdev, 0, sizeof(struct _ptouch_dev));
+	(*ptdev)->ctx=ctx;
+	(*ptdev)->h=handle;
+	(*ptdev)->fd=-1;
+	(*ptdev)->devinfo=info;
+	ptouch_pack_init(&(*ptdev)->pack, 0);	/* until the tape is known */
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Print through the kernel usblp driver instead of libusb. This needs
+	no access to the USB device itself and leaves the printer to the
+	kernel driver. dev is the device node, or NULL to look for a known
+	printer at /dev/usb/lp*. Anything that can be opened for reading
+	and writing works as well, e.g. a pipe or a file for testing. If
+	tape_width_mm is given, that tape is assumed and the status is
+	never read.
+   -------------------------------------------------------------------- */
+#ifdef __linux__
+/* from drivers/usb/class/usblp.c, which has no public header */
+#define IOCNR_GET_VID_PID	6
+#define LPIOC_GET_VID_PID(len)	_IOC(_IOC_READ, 'P', IOCNR_GET_VID_PID, len)
+#endif
+
+/* the known printer behind a usblp device, or NULL */
+static pt_dev_info ptouch_lp_info(int fd)
+{
+#ifdef LPIOC_GET_VID_PID
+	int id[2];
+
+	if (ioctl(fd, LPIOC_GET_VID_PID(sizeof(id)), id) != 0) {
+		return NULL;
+	}
+	for (int k=0; ptdevs[k].vid > 0; k++) {
+		if ((id[0] == ptdevs[k].vid) && (id[1] == ptdevs[k].pid) && (ptdevs[k].flags >= 0)) {
+			return &ptdevs[k];
+		}
+	}
+#endif
+	return NULL;
+}
+
+static int ptouch_lp_find(pt_dev_info *info, int tries)
+{
+	struct timespec w;
+	char name[32];
+	int fd;
+
+	for (int t=0; t<tries; t++) {
+		if (t > 0) {
+			w.tv_sec=0;
+			w.tv_nsec=100000000;	/* 0.1 sec */
+			nanosleep(&w, NULL);
+		}
+		for (int i=0; i<LP_DEVICES; i++) {
+			snprintf(name, sizeof(name), "/dev/usb/lp%i", i);
+			if ((fd=open(name, O_RDWR)) < 0) {
+				continue;
+			}
+			if ((*info=ptouch_lp_info(fd)) != NULL) {
+				fprintf(stderr, _("%s found at %s\n"), (*info)->name, name);
+				return fd;
+			}
+			close(fd);
+		}
+	}
+	fprintf(stderr, _("No P-Touch printer found at /dev/usb/lp*\n"));
 	return -1;
 }
 
+static int ptouch_lp_dev(ptouch_ctx ctx, ptouch_dev *ptdev, int fd, pt_dev_info info, int tape_width_mm)
+{
+	if ((*ptdev=malloc(sizeof(struct _ptouch_dev))) == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		close(fd);
+		return -1;
+	}
+	memset(*ptdev, 0, sizeof(struct _ptouch_dev));
+	(*ptdev)->ctx=ctx;
+	(*ptdev)->h=NULL;
+	(*ptdev)->fd=fd;
+	(*ptdev)->devinfo=info;
+	if (tape_width_mm > 0) {
+		(*ptdev)->tape_width_mm=tape_width_mm;
+		(*ptdev)->tape_width_px=ptouch_tape_px(tape_width_mm);
+	} else {
+		(*ptdev)->lp=1;
+	}
+	ptouch_pack_init(&(*ptdev)->pack, (*ptdev)->tape_width_px);
+	return 0;
+}
+
+int ptouch_open_lp(ptouch_ctx ctx, ptouch_dev *ptdev, const char *dev, int tape_width_mm)
+{
+	pt_dev_info info=NULL;
+	int fd;
+
+	*ptdev=NULL;
+	if ((tape_width_mm > 0) && (ptouch_tape_px(tape_width_mm) <= 0)) {
+		fprintf(stderr, _("unsupported tape width of %imm\n"), tape_width_mm);
+		return -1;
+	}
+	if (dev == NULL) {
+		if ((fd=ptouch_lp_find(&info, 1)) < 0) {
+			return -1;
+		}
+	} else if ((fd=open(dev, O_RDWR)) < 0) {
+		fprintf(stderr, _("could not open '%s': %s\n"), dev, strerror(errno));
+		return -1;
+	} else {
+		info=ptouch_lp_info(fd);
+	}
+	return ptouch_lp_dev(ctx, ptdev, fd, info, tape_width_mm);
+}
+
+/* --------------------------------------------------------------------
+	Instead of a printer, write the raw command stream to a file ("-"
+	is stdout). As there is nobody to ask for the status, the tape
+	width has to be given.
+   -------------------------------------------------------------------- */
+int ptouch_open_file(ptouch_ctx ctx, ptouch_dev *ptdev, const char *file, int tape_width_mm)
+{
+	int fd;
+
+	if (ptouch_tape_px(tape_width_mm) <= 0) {
+		fprintf(stderr, _("unsupported tape width of %imm\n"), tape_width_mm);
+		return -1;
+	}
+	if (strcmp(file, "-") == 0) {
+		fd=STDOUT_FILENO;
+	} else if ((fd=open(file, O_WRONLY|O_CREAT|O_TRUNC, 0644)) < 0) {
+		fprintf(stderr, _("could not open '%s' for writing\n"), file);
+		return -1;
+	}
+	if ((*ptdev=malloc(sizeof(struct _ptouch_dev))) == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		if (fd != STDOUT_FILENO) {
+			close(fd);
+		}
+		return -1;
+	}
+	memset(*ptdev, 0, sizeof(struct _ptouch_dev));
+	(*ptdev)->ctx=ctx;
+	(*ptdev)->h=NULL;
+	(*ptdev)->devinfo=NULL;
+	(*ptdev)->fd=fd;
+	(*ptdev)->tape_width_mm=tape_width_mm;
+	(*ptdev)->tape_width_px=ptouch_tape_px(tape_width_mm);
+	ptouch_pack_init(&(*ptdev)->pack, (*ptdev)->tape_width_px);
+	return 0;
+}
+
 int ptouch_close(ptouch_dev ptdev)
 {
-	libusb_release_interface(ptdev->h, 0);
-	libusb_close(ptdev->h);
+	if (ptdev->h != NULL) {
+		libusb_release_interface(ptdev->h, 0);
+		libusb_close(ptdev->h);
+	} else if ((ptdev->fd >= 0) && (ptdev->fd != STDOUT_FILENO)) {
+		close(ptdev->fd);
+	}
+	free(ptdev);
+	return 0;
+}
+
+static int ptouch_write(ptouch_dev ptdev, uint8_t *data, int len)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		if ((r=write(ptdev->fd, data, len)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, _("write error: %s\n"), strerror(errno));
+			return -1;
+		}
+		data+=r;
+		len-=r;
+	}
 	return 0;
 }
 
 int ptouch_send(ptouch_dev ptdev, uint8_t *data, int len)
 {
 	int r,tx;
+	double t;
 	
 	if (ptdev == NULL) {
 		return -1;
 	}
-	if ((r=libusb_bulk_transfer(ptdev->h, 0x02, data, len, &tx, 0)) != 0) {
-		fprintf(stderr, _("write error: %s\n"), libusb_error_name(r));
-		return -1;
-	}
-	if (tx != len) {
-		fprintf(stderr, _("write error: could send only %i of %i bytes\n"), tx, len);
-		return -1;
+	t=ptouch_now();
+	if (ptdev->h == NULL) {
+		if (ptouch_write(ptdev, data, len) != 0) {
+			return -1;
+		}
+	} else {
+		if ((r=libusb_bulk_transfer(ptdev->h, 0x02, data, len, &tx, 0)) != 0) {
+			fprintf(stderr, _("write error: %s\n"), libusb_error_name(r));
+			return -1;
+		}
+		if (tx != len) {
+			fprintf(stderr, _("write error: could send only %i of %i bytes\n"), tx, len);
+			return -1;
+		}
 	}
+	ptouch_hist_add(&ptdev->stats.transfer, ptouch_now()-t);
+	ptdev->stats.bytes+=len;
 	return 0;
 }
 
@@ -175,13 +526,7 @@ int ptouch_cutmark(ptouch_dev ptdev)
 	buf[0]=0x47;
 	buf[1]=len;
 	buf[2]=0;
-	memset(buf+3, 0, len);
-	int offset=(64-ptouch_getmaxwidth(ptdev)/2);
-	for (i=0; i<ptouch_getmaxwidth(ptdev); i++) {
-		if ((i%8) <= 3) {	/* pixels 0-3 get set, 4-7 are unset */
-			buf[3+15-((offset+i)/8)] |= 1<<((offset+i)%8);
-		}
-	}
+	memcpy(buf+3, ptdev->pack.cutmark, len);
 	ptouch_send(ptdev, buf, len+3);
 	for (i=0; i<CUTMARK_SPACING; i++) {
 		ptouch_lf(ptdev);
@@ -202,20 +547,58 @@ void ptouch_rawstatus(uint8_t raw[32])
 	return;
 }
 
-int ptouch_getstatus(ptouch_dev ptdev)
+/* read what the printer sent, *tx is 0 if there was nothing (yet) */
+static int ptouch_read(ptouch_dev ptdev, uint8_t *buf, int len, int *tx)
+{
+	struct pollfd p;
+	ssize_t n;
+	int r;
+
+	*tx=0;
+	if (ptdev->h != NULL) {
+		if ((r=libusb_bulk_transfer(ptdev->h, 0x81, buf, len, tx, 0)) != 0) {
+			fprintf(stderr, _("read error: %s\n"), libusb_error_name(r));
+			return -1;
+		}
+		return 0;
+	}
+	p.fd=ptdev->fd;
+	p.events=POLLIN;
+	while ((r=poll(&p, 1, 0)) < 0) {
+		if (errno != EINTR) {
+			fprintf(stderr, _("read error: %s\n"), strerror(errno));
+			return -1;
+		}
+	}
+	if (r == 0) {
+		return 0;
+	}
+	while ((n=read(ptdev->fd, buf, len)) < 0) {
+		if (errno == EAGAIN) {
+			return 0;
+		}
+		if (errno != EINTR) {
+			fprintf(stderr, _("read error: %s\n"), strerror(errno));
+			return -1;
+		}
+	}
+	*tx=n;
+	return 0;
+}
+
+static int ptouch_readstatus(ptouch_dev ptdev)
 {
 	char cmd[]="\x1b\x69\x53";
 	uint8_t buf[32];
-	int i, r, tx=0, tries=0;
+	int i, tx=0, tries=0;
 	struct timespec w;
 
 	ptouch_send(ptdev, (uint8_t *)cmd, strlen(cmd));
 	while (tx == 0) {
 		w.tv_sec=0;
 		w.tv_nsec=100000000;	/* 0.1 sec */
-		r=nanosleep(&w, NULL);
-		if ((r=libusb_bulk_transfer(ptdev->h, 0x81, buf, 32, &tx, 0)) != 0) {
-			fprintf(stderr, _("read error: %s\n"), libusb_error_name(r));
+		nanosleep(&w, NULL);
+		if (ptouch_read(ptdev, buf, 32, &tx) != 0) {
 			return -1;
 		}
 		tries++;
@@ -233,6 +616,10 @@ int ptouch_getstatus(ptouch_dev ptdev)
 			if (buf[9] != 0) {
 				fprintf(stderr, _("Error 2 = %02x\n"), buf[9]);
 			}
+			for (i=0; i<8; i++) {
+				ptdev->stats.error[0][i]+=(buf[8]>>i)&1;
+				ptdev->stats.error[1][i]+=(buf[9]>>i)&1;
+			}
 			ptdev->tape_width_mm=buf[10];
 			ptdev->tape_width_px=0;
 			for (i=0; tape_info[i].mm > 0; i++) {
@@ -240,7 +627,9 @@ int ptouch_getstatus(ptouch_dev ptdev)
 					ptdev->tape_width_px=tape_info[i].px;
 				}
 			}
+			ptouch_pack_init(&ptdev->pack, ptdev->tape_width_px);
 			if (ptdev->tape_width_px == 0) {
+				ptdev->stats.unknown_tape++;
 				fprintf(stderr, _("unknown tape width of %imm, please report this.\n"), buf[10]);
 			}
 			ptdev->media_type=buf[11];
@@ -259,19 +648,61 @@ int ptouch_getstatus(ptouch_dev ptdev)
 	fprintf(stderr, _("strange status:\n"));
 	ptouch_rawstatus(buf);
 	fprintf(stderr, _("trying to flush junk\n"));
-	if ((r=libusb_bulk_transfer(ptdev->h, 0x81, buf, 32, &tx, 0)) != 0) {
-		fprintf(stderr, _("read error: %s\n"), libusb_error_name(r));
+	if (ptouch_read(ptdev, buf, 32, &tx) != 0) {
 		return -1;
 	}
 	fprintf(stderr, _("got another %i bytes. now try again\n"), tx);
 	return -1;
 }
 
+int ptouch_getstatus(ptouch_dev ptdev)
+{
+	double t;
+	int r;
+
+	if ((ptdev->h == NULL) && !ptdev->lp) {	/* tape width is known */
+		return 0;
+	}
+	t=ptouch_now();
+	if ((r=ptouch_readstatus(ptdev)) != 0) {
+		ptdev->stats.status_failed++;
+	}
+	ptouch_hist_add(&ptdev->stats.status, ptouch_now()-t);
+	return r;
+}
+
 int ptouch_getmaxwidth(ptouch_dev ptdev)
 {
 	return ptdev->tape_width_px;
 }
 
+/* tape width in mm, 0 if unknown */
+int ptouch_gettapewidth(ptouch_dev ptdev)
+{
+	return ptdev->tape_width_mm;
+}
+
+ptouch_ctx ptouch_dev_ctx(ptouch_dev ptdev)
+{
+	return ptdev->ctx;
+}
+
+const struct _ptouch_stats *ptouch_getstats(ptouch_dev ptdev)
+{
+	return &ptdev->stats;
+}
+
+/* printable px for a tape width in mm, 0 if unknown */
+int ptouch_tape_px(int tape_width_mm)
+{
+	for (int i=0; tape_info[i].mm > 0; i++) {
+		if (tape_info[i].mm == tape_width_mm) {
+			return tape_info[i].px;
+		}
+	}
+	return 0;
+}
+
 int ptouch_sendraster(ptouch_dev ptdev, uint8_t *data, int len)
 {
 	uint8_t buf[32];
@@ -283,5 +714,150 @@ int ptouch_sendraster(ptouch_dev ptdev, uint8_t *data, int len)
 	buf[1]=len;
 	buf[2]=0;
 	memcpy(buf+3, data, len);
-	return ptouch_send(ptdev, buf, len+3);
+	if (ptouch_send(ptdev, buf, len+3) != 0) {
+		return -1;
+	}
+	ptdev->stats.lines++;
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Command buffers: a label is encoded once and can then be sent with
+	a few large transfers instead of one transfer per raster line.
+   -------------------------------------------------------------------- */
+ptouch_buf ptouch_buf_new(void)
+{
+	ptouch_buf b;
+
+	if ((b=malloc(sizeof(struct _ptouch_buf))) == NULL) {
+		return NULL;
+	}
+	b->data=NULL;
+	b->len=0;
+	b->alloc=0;
+	b->lines=0;
+	b->labels=0;
+	b->ctx=NULL;
+	b->next=NULL;
+	return b;
+}
+
+/* an empty buffer from the pool of ctx, see struct _ptouch_pool */
+ptouch_buf ptouch_buf_get(ptouch_ctx ctx)
+{
+	ptouch_buf b;
+
+	pthread_mutex_lock(&ctx->lock);
+	if ((b=ctx->pool.bufs) != NULL) {
+		ctx->pool.bufs=b->next;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	if (b == NULL) {
+		if ((b=ptouch_buf_new()) == NULL) {
+			return NULL;
+		}
+		b->ctx=ctx;
+		ptouch_pool_count(ctx);
+	}
+	b->len=0;
+	b->lines=0;
+	b->labels=0;
+	return b;
+}
+
+void ptouch_buf_free(ptouch_buf b)
+{
+	ptouch_ctx ctx;
+
+	if (b == NULL) {
+		return;
+	}
+	if ((ctx=b->ctx) != NULL) {
+		pthread_mutex_lock(&ctx->lock);
+		b->next=ctx->pool.bufs;
+		ctx->pool.bufs=b;
+		pthread_mutex_unlock(&ctx->lock);
+		return;
+	}
+	free(b->data);
+	free(b);
+}
+
+static int ptouch_buf_grow(ptouch_buf b, size_t len)
+{
+	uint8_t *p;
+	size_t n;
+
+	if (b->len+len <= b->alloc) {
+		return 0;
+	}
+	n=(b->alloc > 0)?b->alloc:4096;
+	while (n < b->len+len) {
+		n*=2;
+	}
+	if ((p=realloc(b->data, n)) == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		return -1;
+	}
+	if (b->ctx != NULL) {
+		ptouch_pool_count(b->ctx);
+	}
+	b->data=p;
+	b->alloc=n;
+	return 0;
+}
+
+int ptouch_buf_add(ptouch_buf b, const uint8_t *data, size_t len)
+{
+	if (ptouch_buf_grow(b, len) != 0) {
+		return -1;
+	}
+	memcpy(b->data+b->len, data, len);
+	b->len+=len;
+	return 0;
+}
+
+/* add raster lines of len bytes each, like ptouch_sendraster() would */
+int ptouch_buf_raster(ptouch_buf b, const uint8_t *data, int lines, int len)
+{
+	uint8_t *p;
+
+	if (len > 16) {
+		return -1;
+	}
+	if (ptouch_buf_grow(b, (size_t)lines*(len+3)) != 0) {
+		return -1;
+	}
+	p=b->data+b->len;
+	for (int i=0; i<lines; i++) {
+		*p++=0x47;
+		*p++=len;
+		*p++=0;
+		memcpy(p, data, len);
+		p+=len;
+		data+=len;
+	}
+	b->len=p-b->data;
+	b->lines+=lines;
+	return 0;
+}
+
+/* bulk transfers are split, a file descriptor gets it all at once */
+#define SEND_CHUNK 16384
+int ptouch_buf_send(ptouch_dev ptdev, ptouch_buf b)
+{
+	size_t ofs, n;
+
+	for (ofs=0; ofs < b->len; ofs+=n) {
+		n=b->len-ofs;
+		if ((ptdev->h != NULL) && (n > SEND_CHUNK)) {
+			n=SEND_CHUNK;
+		}
+		if (ptouch_send(ptdev, b->data+ofs, n) != 0) {
+			return -1;
+		}
+	}
+	ptdev->stats.lines+=b->lines;
+	ptdev->stats.labels+=b->labels;
+	return 0;
 }
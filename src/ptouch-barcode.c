@@ -0,0 +1,566 @@
+/*
+	ptouch-barcode - Code 128 and QR codes rendered straight to raster lines
+
+	Copyright (C) 2015 Dominic Radermacher <dominic.radermacher@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>	/* malloc() */
+#include <string.h>	/* memset(), memcpy() */
+#include "config.h"
+#include "gettext.h"	/* gettext(), ngettext() */
+#include "ptouch.h"
+#include "ptouch-render.h"
+
+#define _(s) gettext(s)
+
+#define CODE128_MODULE	2	/* px per module, 0.28mm at 180dpi */
+#define CODE128_QUIET	10	/* modules of quiet zone on each side */
+#define QR_QUIET	4	/* modules of quiet zone left and right */
+#define QR_MAX_VERSION	10
+#define QR_MAX_SIZE	(17+4*QR_MAX_VERSION)
+
+/* --------------------------------------------------------------------
+	Append width columns to the label, all set to col
+   -------------------------------------------------------------------- */
+static int add_columns(pt_label l, const uint8_t col[PT_RASTER_BYTES], int width)
+{
+	int x=l->width;
+
+	if (pt_label_resize(l, x+width) != 0) {
+		return -1;
+	}
+	for (int i=0; i<width; i++) {
+		memcpy(pt_label_column(l, x+i), col, PT_RASTER_BYTES);
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Code 128
+   -------------------------------------------------------------------- */
+
+/* bar and space widths of the symbols 0..105, 106 is the stop symbol */
+static const char *code128_pattern[107]={
+	"212222", "222122", "222221", "121223", "121322", "131222", "122213",
+	"122312", "132212", "221213", "221312", "231212", "112232", "122132",
+	"122231", "113222", "123122", "123221", "223211", "221132", "221231",
+	"213212", "223112", "312131", "311222", "321122", "321221", "312212",
+	"322112", "322211", "212123", "212321", "232121", "111323", "131123",
+	"131321", "112313", "132113", "132311", "211313", "231113", "231311",
+	"112133", "112331", "132131", "113123", "113321", "133121", "313121",
+	"211331", "231131", "213113", "213311", "213131", "311123", "311321",
+	"331121", "312113", "312311", "332111", "314111", "221411", "431111",
+	"111224", "111422", "121124", "121421", "141122", "141221", "112214",
+	"112412", "122114", "122411", "142112", "142211", "241211", "221114",
+	"413111", "241112", "134111", "111242", "121142", "121241", "114212",
+	"124112", "124211", "411212", "421112", "421211", "212141", "214121",
+	"412121", "111143", "111341", "131141", "114113", "114311", "411113",
+	"411311", "113141", "114131", "311141", "411131", "211412", "211214",
+	"211232", "2331112"
+};
+#define C128_CODE_C	99
+#define C128_CODE_B	100
+#define C128_START_B	104
+#define C128_START_C	105
+#define C128_STOP	106
+
+/* number of digits starting at s */
+static int digit_run(const char *s)
+{
+	int n=0;
+
+	while ((s[n] >= '0') && (s[n] <= '9')) {
+		n++;
+	}
+	return n;
+}
+
+/* --------------------------------------------------------------------
+	Encode data as code set B, switching to code set C for runs of
+	digits where that makes the symbol shorter. Returns the number of
+	symbols including start, checksum and stop, or -1.
+   -------------------------------------------------------------------- */
+static int code128_encode(const char *data, int *sym, int max)
+{
+	int n=0, set, run, sum;
+
+	run=digit_run(data);
+	if ((run >= 4) && ((run%2 == 0) || (run == (int)strlen(data)))) {
+		set=C128_START_C;
+	} else {
+		set=C128_START_B;
+	}
+	sym[n++]=set;
+	while (*data != '\0') {
+		if (n+4 > max) {
+			return -1;
+		}
+		run=digit_run(data);
+		if (set == C128_START_C) {
+			if (run >= 2) {
+				sym[n++]=(data[0]-'0')*10+(data[1]-'0');
+				data+=2;
+				continue;
+			}
+			sym[n++]=C128_CODE_B;
+			set=C128_START_B;
+		}
+		if (run >= 4) {		/* switch for an even number of digits */
+			if (run%2 == 1) {
+				sym[n++]=data[0]-' ';
+				data++;
+			}
+			sym[n++]=C128_CODE_C;
+			set=C128_START_C;
+			continue;
+		}
+		if (((unsigned char)*data < ' ') || ((unsigned char)*data > 127)) {
+			return -1;
+		}
+		sym[n++]=*data-' ';
+		data++;
+	}
+	sum=sym[0];
+	for (int i=1; i<n; i++) {
+		sum+=i*sym[i];
+	}
+	sym[n++]=sum%103;
+	sym[n++]=C128_STOP;
+	return n;
+}
+
+int pt_barcode_code128(pt_label l, const char *data)
+{
+	uint8_t bar[PT_RASTER_BYTES], space[PT_RASTER_BYTES];
+	const char *p;
+	int sym[256], n, i, black;
+
+	if ((n=code128_encode(data, sym, 256)) < 0) {
+		printf(_("can not encode '%s' as code 128\n"), data);
+		return -1;
+	}
+	/* a bar covers the whole printable height */
+	memset(space, 0, sizeof(space));
+	memset(bar, 0, sizeof(bar));
+	for (i=0; i<l->height; i++) {
+		bar[15-((l->offset+i)/8)] |= 1<<((l->offset+i)%8);
+	}
+	if (add_columns(l, space, CODE128_QUIET*CODE128_MODULE) != 0) {
+		return -1;
+	}
+	for (i=0; i<n; i++) {
+		black=1;
+		for (p=code128_pattern[sym[i]]; *p != '\0'; p++) {
+			if (add_columns(l, black?bar:space, (*p-'0')*CODE128_MODULE) != 0) {
+				return -1;
+			}
+			black=!black;
+		}
+	}
+	return add_columns(l, space, CODE128_QUIET*CODE128_MODULE);
+}
+
+/* --------------------------------------------------------------------
+	QR code, byte mode, versions 1 to QR_MAX_VERSION. Error correction
+	level M is used, L if the data does not fit otherwise.
+   -------------------------------------------------------------------- */
+
+struct qr {
+	int version;
+	int size;
+	int ecl;		/* 0 = L, 1 = M */
+	uint8_t mod[QR_MAX_SIZE][QR_MAX_SIZE];	/* 1 = dark */
+	uint8_t fn[QR_MAX_SIZE][QR_MAX_SIZE];	/* 1 = function pattern */
+};
+
+/* [ecl][version] */
+static const int qr_ecc_len[2][QR_MAX_VERSION+1]={
+	{-1,  7, 10, 15, 20, 26, 18, 20, 24, 30, 18},
+	{-1, 10, 16, 26, 18, 24, 16, 18, 22, 22, 26}
+};
+static const int qr_blocks[2][QR_MAX_VERSION+1]={
+	{-1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 4},
+	{-1, 1, 1, 1, 2, 2, 4, 4, 4, 5, 5}
+};
+static const int qr_format_ecl[2]={1, 0};	/* L, M in format info */
+
+/* number of codewords (data and ecc) a version can hold */
+static int qr_raw_codewords(int ver)
+{
+	int n=(16*ver+128)*ver+64, align;
+
+	if (ver >= 2) {
+		align=ver/7+2;
+		n-=(25*align-10)*align-55;
+		if (ver >= 7) {
+			n-=36;
+		}
+	}
+	return n/8;
+}
+
+static int qr_data_codewords(int ver, int ecl)
+{
+	return qr_raw_codewords(ver)-qr_ecc_len[ecl][ver]*qr_blocks[ecl][ver];
+}
+
+static uint8_t gf_mul(uint8_t x, uint8_t y)
+{
+	int z=0;
+
+	for (int i=7; i>=0; i--) {
+		z=(z << 1) ^ ((z >> 7)*0x11d);
+		z^=((y >> i) & 1)*x;
+	}
+	return z;
+}
+
+/* Reed-Solomon remainder of data with a generator of degree n */
+static void qr_ecc(const uint8_t *data, int len, uint8_t *ecc, int n)
+{
+	uint8_t gen[32], root=1, f;
+	int i, j;
+
+	memset(gen, 0, sizeof(gen));
+	gen[n-1]=1;
+	for (i=0; i<n; i++) {
+		for (j=0; j<n; j++) {
+			gen[j]=gf_mul(gen[j], root);
+			if (j+1 < n) {
+				gen[j]^=gen[j+1];
+			}
+		}
+		root=gf_mul(root, 0x02);
+	}
+	memset(ecc, 0, n);
+	for (i=0; i<len; i++) {
+		f=data[i]^ecc[0];
+		memmove(ecc, ecc+1, n-1);
+		ecc[n-1]=0;
+		for (j=0; j<n; j++) {
+			ecc[j]^=gf_mul(gen[j], f);
+		}
+	}
+}
+
+static void qr_set_fn(struct qr *q, int x, int y, int dark)
+{
+	q->mod[y][x]=dark;
+	q->fn[y][x]=1;
+}
+
+static void qr_finder(struct qr *q, int cx, int cy)
+{
+	int dx, dy, d, x, y;
+
+	for (dy=-4; dy<=4; dy++) {
+		for (dx=-4; dx<=4; dx++) {
+			x=cx+dx;
+			y=cy+dy;
+			if ((x < 0) || (x >= q->size) || (y < 0) || (y >= q->size)) {
+				continue;
+			}
+			d=(abs(dx) > abs(dy))?abs(dx):abs(dy);
+			qr_set_fn(q, x, y, (d != 2) && (d != 4));
+		}
+	}
+}
+
+static void qr_format(struct qr *q, int mask)
+{
+	int data=(qr_format_ecl[q->ecl] << 3) | mask, rem=data, bits, i;
+
+	for (i=0; i<10; i++) {
+		rem=(rem << 1) ^ ((rem >> 9)*0x537);
+	}
+	bits=((data << 10) | rem) ^ 0x5412;
+	for (i=0; i<=5; i++) {
+		qr_set_fn(q, 8, i, (bits >> i) & 1);
+	}
+	qr_set_fn(q, 8, 7, (bits >> 6) & 1);
+	qr_set_fn(q, 8, 8, (bits >> 7) & 1);
+	qr_set_fn(q, 7, 8, (bits >> 8) & 1);
+	for (i=9; i<15; i++) {
+		qr_set_fn(q, 14-i, 8, (bits >> i) & 1);
+	}
+	for (i=0; i<8; i++) {
+		qr_set_fn(q, q->size-1-i, 8, (bits >> i) & 1);
+	}
+	for (i=8; i<15; i++) {
+		qr_set_fn(q, 8, q->size-15+i, (bits >> i) & 1);
+	}
+	qr_set_fn(q, 8, q->size-8, 1);		/* always dark */
+}
+
+static void qr_function_patterns(struct qr *q)
+{
+	int pos[7], n, step, i, j, dx, dy, rem, bits;
+
+	for (i=0; i<q->size; i++) {		/* timing patterns */
+		qr_set_fn(q, 6, i, i%2 == 0);
+		qr_set_fn(q, i, 6, i%2 == 0);
+	}
+	qr_finder(q, 3, 3);
+	qr_finder(q, q->size-4, 3);
+	qr_finder(q, 3, q->size-4);
+	if (q->version >= 2) {			/* alignment patterns */
+		n=q->version/7+2;
+		step=(q->version*4+n*2+1)/(n*2-2)*2;
+		pos[0]=6;
+		for (i=n-1, j=q->size-7; i>=1; i--, j-=step) {
+			pos[i]=j;
+		}
+		for (i=0; i<n; i++) {
+			for (j=0; j<n; j++) {
+				if (((i == 0) && (j == 0)) || ((i == 0) && (j == n-1)) || ((i == n-1) && (j == 0))) {
+					continue;	/* finder patterns are there */
+				}
+				for (dy=-2; dy<=2; dy++) {
+					for (dx=-2; dx<=2; dx++) {
+						qr_set_fn(q, pos[i]+dx, pos[j]+dy,
+							((abs(dx) > abs(dy))?abs(dx):abs(dy)) != 1);
+					}
+				}
+			}
+		}
+	}
+	qr_format(q, 0);			/* reserve the area */
+	if (q->version >= 7) {
+		rem=q->version;
+		for (i=0; i<12; i++) {
+			rem=(rem << 1) ^ ((rem >> 11)*0x1f25);
+		}
+		bits=(q->version << 12) | rem;
+		for (i=0; i<18; i++) {
+			qr_set_fn(q, q->size-11+i%3, i/3, (bits >> i) & 1);
+			qr_set_fn(q, i/3, q->size-11+i%3, (bits >> i) & 1);
+		}
+	}
+}
+
+static void qr_codewords(struct qr *q, const uint8_t *cw, int len)
+{
+	int i=0, right, vert, j, x, y, up;
+
+	for (right=q->size-1; right>=1; right-=2) {
+		if (right == 6) {
+			right=5;
+		}
+		for (vert=0; vert<q->size; vert++) {
+			for (j=0; j<2; j++) {
+				x=right-j;
+				up=((right+1) & 2) == 0;
+				y=up?q->size-1-vert:vert;
+				if (!q->fn[y][x] && (i < len*8)) {
+					q->mod[y][x]=(cw[i >> 3] >> (7-(i & 7))) & 1;
+					i++;
+				}
+			}
+		}
+	}
+}
+
+static int qr_mask_bit(int mask, int x, int y)
+{
+	switch (mask) {
+	case 0: return (x+y)%2 == 0;
+	case 1: return y%2 == 0;
+	case 2: return x%3 == 0;
+	case 3: return (x+y)%3 == 0;
+	case 4: return (x/3+y/2)%2 == 0;
+	case 5: return x*y%2+x*y%3 == 0;
+	case 6: return (x*y%2+x*y%3)%2 == 0;
+	default: return ((x+y)%2+x*y%3)%2 == 0;
+	}
+}
+
+static void qr_apply_mask(struct qr *q, int mask)
+{
+	for (int y=0; y<q->size; y++) {
+		for (int x=0; x<q->size; x++) {
+			if (!q->fn[y][x] && qr_mask_bit(mask, x, y)) {
+				q->mod[y][x]^=1;
+			}
+		}
+	}
+}
+
+/* penalty score of the symbol, rules N1, N2 and N4 of the standard */
+static long qr_penalty(struct qr *q)
+{
+	long p=0;
+	int x, y, run, dark=0, c, k;
+
+	for (k=0; k<2; k++) {			/* N1: runs of 5 or more */
+		for (y=0; y<q->size; y++) {
+			run=1;
+			for (x=1; x<q->size; x++) {
+				c=k?(q->mod[x][y] == q->mod[x-1][y]):(q->mod[y][x] == q->mod[y][x-1]);
+				if (c) {
+					run++;
+					if (run == 5) {
+						p+=3;
+					} else if (run > 5) {
+						p++;
+					}
+				} else {
+					run=1;
+				}
+			}
+		}
+	}
+	for (y=0; y+1<q->size; y++) {		/* N2: 2x2 blocks */
+		for (x=0; x+1<q->size; x++) {
+			c=q->mod[y][x];
+			if ((c == q->mod[y][x+1]) && (c == q->mod[y+1][x]) && (c == q->mod[y+1][x+1])) {
+				p+=3;
+			}
+		}
+	}
+	for (y=0; y<q->size; y++) {		/* N4: dark/light balance */
+		for (x=0; x<q->size; x++) {
+			dark+=q->mod[y][x];
+		}
+	}
+	k=abs(dark*20-q->size*q->size*10)/(q->size*q->size);
+	p+=k*10;
+	return p;
+}
+
+static int qr_build(struct qr *q, const char *data)
+{
+	uint8_t buf[QR_MAX_SIZE*QR_MAX_SIZE/8], cw[QR_MAX_SIZE*QR_MAX_SIZE/8];
+	uint8_t ecc[QR_MAX_VERSION*2][32];
+	int len=strlen(data), ver, ecl, cap=0, nbits, bit, i, j, k;
+	int raw, blocks, ecclen, shortlen, best=0, ofs;
+	long pen, bestpen=-1;
+
+	for (ecl=1; ecl>=0; ecl--) {		/* M first, then L */
+		for (ver=1; ver<=QR_MAX_VERSION; ver++) {
+			cap=qr_data_codewords(ver, ecl);
+			nbits=4+((ver < 10)?8:16)+8*len;
+			if (nbits <= cap*8) {
+				break;
+			}
+		}
+		if (ver <= QR_MAX_VERSION) {
+			break;
+		}
+	}
+	if (ecl < 0) {
+		return -1;
+	}
+	memset(q, 0, sizeof(struct qr));
+	q->version=ver;
+	q->size=17+4*ver;
+	q->ecl=ecl;
+	/* data bits: mode, length, data, terminator, padding */
+	memset(buf, 0, sizeof(buf));
+	bit=0;
+#define PUT(v, n) for (k=(n)-1; k>=0; k--, bit++) { if (((v) >> k) & 1) buf[bit >> 3] |= 0x80 >> (bit & 7); }
+	PUT(4, 4);
+	PUT(len, (ver < 10)?8:16);
+	for (i=0; i<len; i++) {
+		PUT((uint8_t)data[i], 8);
+	}
+#undef PUT
+	bit+=(cap*8-bit < 4)?cap*8-bit:4;
+	bit=(bit+7)/8;
+	for (i=0; bit<cap; bit++, i++) {
+		buf[bit]=(i%2)?0x11:0xec;
+	}
+	/* split into blocks, add ecc and interleave */
+	raw=qr_raw_codewords(ver);
+	blocks=qr_blocks[ecl][ver];
+	ecclen=qr_ecc_len[ecl][ver];
+	shortlen=raw/blocks-ecclen;		/* data in a short block */
+	for (i=0, ofs=0; i<blocks; i++) {
+		k=shortlen+((i >= blocks-raw%blocks)?1:0);
+		qr_ecc(buf+ofs, k, ecc[i], ecclen);
+		ofs+=k;
+	}
+	k=0;
+	for (j=0; j<=shortlen; j++) {
+		for (i=0, ofs=0; i<blocks; i++) {
+			int blen=shortlen+((i >= blocks-raw%blocks)?1:0);
+			if (j < blen) {
+				cw[k++]=buf[ofs+j];
+			}
+			ofs+=blen;
+		}
+	}
+	for (j=0; j<ecclen; j++) {
+		for (i=0; i<blocks; i++) {
+			cw[k++]=ecc[i][j];
+		}
+	}
+	qr_function_patterns(q);
+	qr_codewords(q, cw, k);
+	for (i=0; i<8; i++) {			/* pick the best mask */
+		qr_apply_mask(q, i);
+		qr_format(q, i);
+		pen=qr_penalty(q);
+		if ((bestpen < 0) || (pen < bestpen)) {
+			bestpen=pen;
+			best=i;
+		}
+		qr_apply_mask(q, i);		/* undo */
+	}
+	qr_apply_mask(q, best);
+	qr_format(q, best);
+	return 0;
+}
+
+int pt_barcode_qr(pt_label l, const char *data)
+{
+	struct qr *q;
+	uint8_t col[PT_RASTER_BYTES];
+	int scale, top, x, y, px, r;
+
+	if ((q=malloc(sizeof(struct qr))) == NULL) {
+		return -1;
+	}
+	if (qr_build(q, data) != 0) {
+		printf(_("'%s' is too long for a QR code\n"), data);
+		free(q);
+		return -1;
+	}
+	if ((scale=l->height/q->size) < 1) {
+		printf(_("QR code does not fit on this tape\n"));
+		free(q);
+		return -1;
+	}
+	top=(l->height-q->size*scale)/2;
+	memset(col, 0, sizeof(col));
+	r=add_columns(l, col, QR_QUIET*scale);
+	for (x=0; (r == 0) && (x < q->size); x++) {
+		memset(col, 0, sizeof(col));
+		for (y=0; y<q->size*scale; y++) {
+			if (q->mod[y/scale][x]) {
+				px=l->offset+l->height-1-(top+y);
+				col[15-(px/8)] |= 1<<(px%8);
+			}
+		}
+		r=add_columns(l, col, scale);
+	}
+	if (r == 0) {
+		memset(col, 0, sizeof(col));
+		r=add_columns(l, col, QR_QUIET*scale);
+	}
+	free(q);
+	return r;
+}
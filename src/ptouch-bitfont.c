@@ -0,0 +1,205 @@
+/*
+	ptouch-bitfont - bitmap fonts compiled into the library
+
+	Copyright (C) 2015 Dominic Radermacher <dominic.radermacher@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <string.h>	/* strcmp() */
+#include "ptouch.h"
+#include "ptouch-render.h"
+
+/* the classic 5x7 font for ASCII 32..126, one byte per column from
+   left to right, bit 0 is the top row */
+static const uint8_t font_5x7[95*5]= {
+	0x00, 0x00, 0x00, 0x00, 0x00,	/* ' ' */
+	0x00, 0x00, 0x5f, 0x00, 0x00,	/* '!' */
+	0x00, 0x07, 0x00, 0x07, 0x00,	/* '"' */
+	0x14, 0x7f, 0x14, 0x7f, 0x14,	/* '#' */
+	0x24, 0x2a, 0x7f, 0x2a, 0x12,	/* '$' */
+	0x23, 0x13, 0x08, 0x64, 0x62,	/* '%' */
+	0x36, 0x49, 0x55, 0x22, 0x50,	/* '&' */
+	0x00, 0x05, 0x03, 0x00, 0x00,	/* ''' */
+	0x00, 0x1c, 0x22, 0x41, 0x00,	/* '(' */
+	0x00, 0x41, 0x22, 0x1c, 0x00,	/* ')' */
+	0x08, 0x2a, 0x1c, 0x2a, 0x08,	/* '*' */
+	0x08, 0x08, 0x3e, 0x08, 0x08,	/* '+' */
+	0x00, 0x50, 0x30, 0x00, 0x00,	/* ',' */
+	0x08, 0x08, 0x08, 0x08, 0x08,	/* '-' */
+	0x00, 0x60, 0x60, 0x00, 0x00,	/* '.' */
+	0x20, 0x10, 0x08, 0x04, 0x02,	/* '/' */
+	0x3e, 0x51, 0x49, 0x45, 0x3e,	/* '0' */
+	0x00, 0x42, 0x7f, 0x40, 0x00,	/* '1' */
+	0x42, 0x61, 0x51, 0x49, 0x46,	/* '2' */
+	0x21, 0x41, 0x45, 0x4b, 0x31,	/* '3' */
+	0x18, 0x14, 0x12, 0x7f, 0x10,	/* '4' */
+	0x27, 0x45, 0x45, 0x45, 0x39,	/* '5' */
+	0x3c, 0x4a, 0x49, 0x49, 0x30,	/* '6' */
+	0x01, 0x71, 0x09, 0x05, 0x03,	/* '7' */
+	0x36, 0x49, 0x49, 0x49, 0x36,	/* '8' */
+	0x06, 0x49, 0x49, 0x29, 0x1e,	/* '9' */
+	0x00, 0x36, 0x36, 0x00, 0x00,	/* ':' */
+	0x00, 0x56, 0x36, 0x00, 0x00,	/* ';' */
+	0x08, 0x14, 0x22, 0x41, 0x00,	/* '<' */
+	0x14, 0x14, 0x14, 0x14, 0x14,	/* '=' */
+	0x00, 0x41, 0x22, 0x14, 0x08,	/* '>' */
+	0x02, 0x01, 0x51, 0x09, 0x06,	/* '?' */
+	0x32, 0x49, 0x79, 0x41, 0x3e,	/* '@' */
+	0x7e, 0x11, 0x11, 0x11, 0x7e,	/* 'A' */
+	0x7f, 0x49, 0x49, 0x49, 0x36,	/* 'B' */
+	0x3e, 0x41, 0x41, 0x41, 0x22,	/* 'C' */
+	0x7f, 0x41, 0x41, 0x22, 0x1c,	/* 'D' */
+	0x7f, 0x49, 0x49, 0x49, 0x41,	/* 'E' */
+	0x7f, 0x09, 0x09, 0x09, 0x01,	/* 'F' */
+	0x3e, 0x41, 0x49, 0x49, 0x7a,	/* 'G' */
+	0x7f, 0x08, 0x08, 0x08, 0x7f,	/* 'H' */
+	0x00, 0x41, 0x7f, 0x41, 0x00,	/* 'I' */
+	0x20, 0x40, 0x41, 0x3f, 0x01,	/* 'J' */
+	0x7f, 0x08, 0x14, 0x22, 0x41,	/* 'K' */
+	0x7f, 0x40, 0x40, 0x40, 0x40,	/* 'L' */
+	0x7f, 0x02, 0x0c, 0x02, 0x7f,	/* 'M' */
+	0x7f, 0x04, 0x08, 0x10, 0x7f,	/* 'N' */
+	0x3e, 0x41, 0x41, 0x41, 0x3e,	/* 'O' */
+	0x7f, 0x09, 0x09, 0x09, 0x06,	/* 'P' */
+	0x3e, 0x41, 0x51, 0x21, 0x5e,	/* 'Q' */
+	0x7f, 0x09, 0x19, 0x29, 0x46,	/* 'R' */
+	0x46, 0x49, 0x49, 0x49, 0x31,	/* 'S' */
+	0x01, 0x01, 0x7f, 0x01, 0x01,	/* 'T' */
+	0x3f, 0x40, 0x40, 0x40, 0x3f,	/* 'U' */
+	0x1f, 0x20, 0x40, 0x20, 0x1f,	/* 'V' */
+	0x3f, 0x40, 0x38, 0x40, 0x3f,	/* 'W' */
+	0x63, 0x14, 0x08, 0x14, 0x63,	/* 'X' */
+	0x07, 0x08, 0x70, 0x08, 0x07,	/* 'Y' */
+	0x61, 0x51, 0x49, 0x45, 0x43,	/* 'Z' */
+	0x00, 0x7f, 0x41, 0x41, 0x00,	/* '[' */
+	0x02, 0x04, 0x08, 0x10, 0x20,	/* '\' */
+	0x00, 0x41, 0x41, 0x7f, 0x00,	/* ']' */
+	0x04, 0x02, 0x01, 0x02, 0x04,	/* '^' */
+	0x40, 0x40, 0x40, 0x40, 0x40,	/* '_' */
+	0x00, 0x01, 0x02, 0x04, 0x00,	/* '`' */
+	0x20, 0x54, 0x54, 0x54, 0x78,	/* 'a' */
+	0x7f, 0x48, 0x44, 0x44, 0x38,	/* 'b' */
+	0x38, 0x44, 0x44, 0x44, 0x20,	/* 'c' */
+	0x38, 0x44, 0x44, 0x48, 0x7f,	/* 'd' */
+	0x38, 0x54, 0x54, 0x54, 0x18,	/* 'e' */
+	0x08, 0x7e, 0x09, 0x01, 0x02,	/* 'f' */
+	0x0c, 0x52, 0x52, 0x52, 0x3e,	/* 'g' */
+	0x7f, 0x08, 0x04, 0x04, 0x78,	/* 'h' */
+	0x00, 0x44, 0x7d, 0x40, 0x00,	/* 'i' */
+	0x20, 0x40, 0x44, 0x3d, 0x00,	/* 'j' */
+	0x7f, 0x10, 0x28, 0x44, 0x00,	/* 'k' */
+	0x00, 0x41, 0x7f, 0x40, 0x00,	/* 'l' */
+	0x7c, 0x04, 0x18, 0x04, 0x78,	/* 'm' */
+	0x7c, 0x08, 0x04, 0x04, 0x78,	/* 'n' */
+	0x38, 0x44, 0x44, 0x44, 0x38,	/* 'o' */
+	0x7c, 0x14, 0x14, 0x14, 0x08,	/* 'p' */
+	0x08, 0x14, 0x14, 0x18, 0x7c,	/* 'q' */
+	0x7c, 0x08, 0x04, 0x04, 0x08,	/* 'r' */
+	0x48, 0x54, 0x54, 0x54, 0x20,	/* 's' */
+	0x04, 0x3f, 0x44, 0x40, 0x20,	/* 't' */
+	0x3c, 0x40, 0x40, 0x20, 0x7c,	/* 'u' */
+	0x1c, 0x20, 0x40, 0x20, 0x1c,	/* 'v' */
+	0x3c, 0x40, 0x30, 0x40, 0x3c,	/* 'w' */
+	0x44, 0x28, 0x10, 0x28, 0x44,	/* 'x' */
+	0x0c, 0x50, 0x50, 0x50, 0x3c,	/* 'y' */
+	0x44, 0x64, 0x54, 0x4c, 0x44,	/* 'z' */
+	0x00, 0x08, 0x36, 0x41, 0x00,	/* '{' */
+	0x00, 0x00, 0x7f, 0x00, 0x00,	/* '|' */
+	0x00, 0x41, 0x36, 0x08, 0x00,	/* '}' */
+	0x08, 0x04, 0x08, 0x10, 0x08,	/* '~' */
+};
+
+/* The 10x14 fonts are 5x7 scaled up with Scale2x (EPX): each pixel
+   becomes 2x2, and a corner takes the colour of its two neighbours
+   when they agree. That rounds the diagonals off, so on 12mm and
+   wider tape they look better than 5x7 at twice the size. */
+static const struct _pt_bitfont bitfonts[]= {
+	{"5x7", 5, 7, 0, 0, ' ', '~', font_5x7},
+	{"5x7bold", 5, 7, 1, 0, ' ', '~', font_5x7},
+	{"10x14", 10, 14, 0, 1, ' ', '~', font_5x7},
+	{"10x14bold", 10, 14, 2, 1, ' ', '~', font_5x7},
+	{NULL, 0, 0, 0, 0, 0, 0, NULL}	/* terminating entry */
+};
+
+const struct _pt_bitfont *pt_bitfont_find(const char *name)
+{
+	for (int i=0; bitfonts[i].name != NULL; i++) {
+		if (strcmp(bitfonts[i].name, name) == 0) {
+			return &bitfonts[i];
+		}
+	}
+	return NULL;
+}
+
+/* column x of the glyph data g with w columns, bold fonts have
+   every column drawn twice */
+static uint8_t glyph_column(const struct _pt_bitfont *f, const uint8_t *g, int w, int x)
+{
+	uint8_t col=0;
+
+	if ((x >= 0) && (x < w)) {
+		col=g[x];
+	}
+	if (f->bold && (x > 0) && (x <= w)) {
+		col|=g[x-1];
+	}
+	return col;
+}
+
+/* pixel of the glyph data, 0 outside of it */
+static int glyph_px(const struct _pt_bitfont *f, const uint8_t *g, int w, int x, int y)
+{
+	if ((y < 0) || (y >= f->height/2)) {
+		return 0;
+	}
+	return (glyph_column(f, g, w, x) >> y) & 1;
+}
+
+/* column c of the glyph data scaled up with Scale2x */
+static uint16_t glyph_smooth(const struct _pt_bitfont *f, const uint8_t *g, int w, int c)
+{
+	uint16_t col=0;
+	int x=c/2, y, p, a, b, d, n, top, bottom;
+
+	for (y=0; y<f->height/2; y++) {
+		p=glyph_px(f, g, w, x, y);
+		a=glyph_px(f, g, w, x, y-1);	/* above */
+		d=glyph_px(f, g, w, x, y+1);	/* below */
+		n=glyph_px(f, g, w, (c & 1)?x+1:x-1, y);	/* next to this half */
+		b=glyph_px(f, g, w, (c & 1)?x-1:x+1, y);	/* on the other side */
+		top=((n == a) && (n != d) && (a != b))?a:p;
+		bottom=((n == d) && (n != a) && (d != b))?d:p;
+		col|=(top << (2*y)) | (bottom << (2*y+1));
+	}
+	return col;
+}
+
+/* column c of a character, bit 0 is the top row. Characters not in
+   the font are drawn as '?' */
+uint16_t pt_bitfont_column(const struct _pt_bitfont *f, unsigned long ch, int c)
+{
+	int w=f->smooth?(f->width/2):f->width;	/* columns in glyph */
+
+	if ((ch < (unsigned long)f->first) || (ch > (unsigned long)f->last)) {
+		ch='?';
+	}
+	if ((c < 0) || (c >= f->width+f->bold)) {
+		return 0;
+	}
+	if (f->smooth) {
+		return glyph_smooth(f, f->glyph+(ch-f->first)*w, w, c);
+	}
+	return glyph_column(f, f->glyph+(ch-f->first)*w, w, c);
+}
@@ -17,23 +17,97 @@
 	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
+#include <stdarg.h>
+#include <string.h>
 #include <gtk/gtk.h>
+#include "ptouch.h"
+#include "ptouch-render.h"
 
 #define BUILDER_XML_FILE "data/ptouch.ui"
+#define PREVIEW_LINES	2	/* entry1/fontselect1, entry2/fontselect2 */
+#define PREVIEW_DELAY	150	/* ms to wait for more typing before rendering */
+#define PREVIEW_TAPE	12	/* tape width in mm until a printer tells us */
+#define PRINT_CHUNK	64	/* columns sent between progress reports */
+
+/* a snapshot of the UI for the render thread */
+typedef struct
+{
+	gint		generation;
+	int		job;		/* print job number, 0 for a preview */
+	gchar		*text[PREVIEW_LINES];
+	gchar		*font[PREVIEW_LINES];
+	int		tape_width;
+} RenderRequest;
+
+/* what the render thread remembers about one line of text */
+typedef struct
+{
+	gchar		*text;
+	gchar		*font;
+	int		fit_px;		/* height the fit was done for */
+	int		fit;		/* biggest font size for fit_px */
+	int		size;		/* rendered with this font size */
+	int		tape_width;
+	int		n, lines;	/* slot on the tape */
+	pt_label	img;		/* NULL if not rendered */
+} LineCache;
 
 typedef struct
 {
 	GtkWidget	*window;
 	GtkWidget	*statusbar;
-	GtkWidget	*text_view;
+	GtkWidget	*preview;
+	GtkWidget	*entry[PREVIEW_LINES];
+	GtkWidget	*fontselect[PREVIEW_LINES];
 	guint		statusbar_context_id;
+	guint		preview_timer;
+	int		tape_width;
+	/* Previews are rendered by renderer, labels to print by printer.
+	   The font and glyph caches of ctx and the line cache are only
+	   used with render_lock held, never from the main loop. Every change
+	   of the UI increments generation, a preview of an older
+	   generation is abandoned and its result thrown away. */
+	GThread		*renderer;
+	GMutex		lock;		/* protects request and quit */
+	GCond		cond;
+	RenderRequest	*request;
+	gboolean	quit;
+	gint		generation;	/* atomic */
+	ptouch_ctx	ctx;
+	GMutex		render_lock;
+	LineCache	line[PREVIEW_LINES];
+	/* Print jobs are queued to printer, which owns the USB device
+	   and reports back through status_done() in the main loop. */
+	GThread		*printer;
+	GAsyncQueue	*jobs;
+	int		jobs_queued;
 } PTouchEditor;
 
+typedef struct
+{
+	PTouchEditor	*editor;
+	gint		generation;
+	GdkPixbuf	*pixbuf;	/* NULL if there is nothing to show */
+} RenderResult;
+
+typedef struct
+{
+	PTouchEditor	*editor;
+	gchar		*text;
+	int		tape_width;	/* tape found in the printer, or 0 */
+} StatusMessage;
+
+/* pushed in front of the job queue to stop the printer thread */
+static RenderRequest print_quit;
+
 /* prototypes */
 void error_message(const gchar *message);
 void on_window_destroy(GtkWidget *object, PTouchEditor *editor);
 gboolean on_window_delete_event(GtkWidget *widget, GdkEvent *event,
 	PTouchEditor *editor);
+void update_preview(GtkWidget *widget, PTouchEditor *editor);
+void print_all(GtkWidget *widget, PTouchEditor *editor);
+void show_about(GtkWidget *widget, PTouchEditor *editor);
 gboolean init_app(PTouchEditor *editor);
 
 void error_message(const gchar *message)
@@ -49,8 +123,404 @@ void error_message(const gchar *message)
 	gtk_widget_destroy(dialog);
 }
 
+static void render_request_free(RenderRequest *req)
+{
+	if (req == NULL) {
+		return;
+	}
+	for (int i=0; i<PREVIEW_LINES; i++) {
+		g_free(req->text[i]);
+		g_free(req->font[i]);
+	}
+	g_slice_free(RenderRequest, req);
+}
+
+static gboolean is_stale(PTouchEditor *editor, gint generation)
+{
+	return g_atomic_int_get(&editor->generation) != generation;
+}
+
+/* print jobs are never abandoned */
+static gboolean request_stale(PTouchEditor *editor, RenderRequest *req)
+{
+	return (req->job == 0) && is_stale(editor, req->generation);
+}
+
+/* convert a font chooser selection into a fontconfig pattern */
+static gchar *font_pattern(GtkWidget *button)
+{
+	PangoFontDescription *desc;
+	const char *family=NULL;
+	GString *s;
+
+	desc=gtk_font_chooser_get_font_desc(GTK_FONT_CHOOSER(button));
+	if (desc != NULL) {
+		family=pango_font_description_get_family(desc);
+	}
+	s=g_string_new((family != NULL)?family:"DejaVuSans");
+	if (desc != NULL) {
+		if (pango_font_description_get_weight(desc) >= PANGO_WEIGHT_BOLD) {
+			g_string_append(s, ":bold");
+		}
+		if (pango_font_description_get_style(desc) != PANGO_STYLE_NORMAL) {
+			g_string_append(s, ":italic");
+		}
+		pango_font_description_free(desc);
+	}
+	return g_string_free(s, FALSE);
+}
+
+static GdkPixbuf *label_to_pixbuf(pt_label l)
+{
+	GdkPixbuf *pb;
+	guchar *row, *p;
+	int x, y, stride, v;
+
+	if ((pb=gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, l->width, l->height)) == NULL) {
+		return NULL;
+	}
+	stride=gdk_pixbuf_get_rowstride(pb);
+	row=gdk_pixbuf_get_pixels(pb);
+	for (y=0; y<l->height; y++, row+=stride) {
+		for (x=0, p=row; x<l->width; x++, p+=3) {
+			v=pt_label_getpixel(l, x, y)?0:255;
+			p[0]=p[1]=p[2]=v;
+		}
+	}
+	return pb;
+}
+
+static void line_cache_clear(LineCache *c)
+{
+	g_free(c->text);
+	g_free(c->font);
+	pt_label_free(c->img);
+	memset(c, 0, sizeof(LineCache));
+}
+
+/* a different text or font invalidates everything known about a line */
+static void line_cache_update(LineCache *c, const gchar *text, const gchar *font)
+{
+	if ((g_strcmp0(c->text, text) == 0) && (g_strcmp0(c->font, font) == 0)) {
+		return;
+	}
+	line_cache_clear(c);
+	c->text=g_strdup(text);
+	c->font=g_strdup(font);
+}
+
+/* font size fitting is expensive, only redo it if the height changed */
+static int line_cache_fit(ptouch_ctx ctx, LineCache *c, int want_px)
+{
+	if ((c->fit_px != want_px) || (c->fit == 0)) {
+		c->fit_px=want_px;
+		c->fit=pt_text_fit(ctx, c->font, c->text, want_px);
+	}
+	return c->fit;
+}
+
+static pt_label line_cache_render(ptouch_ctx ctx, LineCache *c, int size, int tape_width, int n, int lines)
+{
+	if ((c->img != NULL) && (c->size == size) && (c->tape_width == tape_width) &&
+	    (c->n == n) && (c->lines == lines)) {
+		return c->img;
+	}
+	pt_label_free(c->img);
+	c->img=pt_render_line(ctx, c->font, size, c->text, tape_width, n, lines);
+	c->size=size;
+	c->tape_width=tape_width;
+	c->n=n;
+	c->lines=lines;
+	return c->img;
+}
+
+/* --------------------------------------------------------------------
+	Render a request the same way ptouch-print --text does: all lines
+	share the biggest font size where every line fits into its part
+	of the tape. Each line is measured and rendered into editor->line
+	and only done again when its text, font, size or slot changed, the
+	label is then composed from the cached lines. Returns NULL if
+	nothing is to be shown or the request became stale. Must be called
+	with render_lock held.
+   -------------------------------------------------------------------- */
+static pt_label render_label(PTouchEditor *editor, RenderRequest *req)
+{
+	int i, n, lines=0, size=0, tmp;
+	int idx[PREVIEW_LINES];
+	LineCache *c;
+	pt_label l, line;
+
+	for (i=0; i<PREVIEW_LINES; i++) {
+		line_cache_update(&editor->line[i], req->text[i], req->font[i]);
+		if (req->text[i][0] != '\0') {
+			idx[lines++]=i;
+		}
+	}
+	if (lines == 0) {
+		return NULL;
+	}
+	for (n=0; n<lines; n++) {
+		c=&editor->line[idx[n]];
+		if ((tmp=line_cache_fit(editor->ctx, c, req->tape_width/lines)) < 0) {
+			return NULL;
+		}
+		if ((size == 0) || (tmp < size)) {
+			size=tmp;
+		}
+		if (request_stale(editor, req)) {
+			return NULL;
+		}
+	}
+	for (n=0; n<lines; n++) {
+		line_cache_render(editor->ctx, &editor->line[idx[n]], size, req->tape_width, n, lines);
+		if (request_stale(editor, req)) {
+			return NULL;
+		}
+	}
+	if ((l=pt_label_get(editor->ctx, req->tape_width, 0)) == NULL) {
+		return NULL;
+	}
+	for (n=0; n<lines; n++) {
+		if ((line=editor->line[idx[n]].img) != NULL) {
+			pt_label_merge(l, line);
+		}
+	}
+	return l;
+}
+
+static gboolean preview_done(gpointer data)
+{
+	RenderResult *res=data;
+
+	if (!is_stale(res->editor, res->generation)) {
+		if (res->pixbuf != NULL) {
+			gtk_image_set_from_pixbuf(GTK_IMAGE(res->editor->preview), res->pixbuf);
+		} else {
+			gtk_image_clear(GTK_IMAGE(res->editor->preview));
+		}
+	}
+	if (res->pixbuf != NULL) {
+		g_object_unref(res->pixbuf);
+	}
+	g_slice_free(RenderResult, res);
+	return G_SOURCE_REMOVE;
+}
+
+static gpointer render_thread(gpointer data)
+{
+	PTouchEditor *editor=data;
+	RenderRequest *req;
+	RenderResult *res;
+	pt_label l;
+
+	for (;;) {
+		g_mutex_lock(&editor->lock);
+		while ((editor->request == NULL) && !editor->quit) {
+			g_cond_wait(&editor->cond, &editor->lock);
+		}
+		if (editor->quit) {
+			g_mutex_unlock(&editor->lock);
+			break;
+		}
+		req=editor->request;
+		editor->request=NULL;
+		g_mutex_unlock(&editor->lock);
+		g_mutex_lock(&editor->render_lock);
+		l=render_label(editor, req);
+		g_mutex_unlock(&editor->render_lock);
+		if (!is_stale(editor, req->generation)) {
+			res=g_slice_new(RenderResult);
+			res->editor=editor;
+			res->generation=req->generation;
+			res->pixbuf=(l != NULL)?label_to_pixbuf(l):NULL;
+			g_idle_add(preview_done, res);
+		}
+		pt_label_free(l);
+		render_request_free(req);
+	}
+	return NULL;
+}
+
+static gboolean status_done(gpointer data)
+{
+	StatusMessage *msg=data;
+	PTouchEditor *editor=msg->editor;
+
+	if (!editor->quit) {
+		gtk_statusbar_pop(GTK_STATUSBAR(editor->statusbar), editor->statusbar_context_id);
+		gtk_statusbar_push(GTK_STATUSBAR(editor->statusbar), editor->statusbar_context_id, msg->text);
+		if ((msg->tape_width > 0) && (msg->tape_width != editor->tape_width)) {
+			editor->tape_width=msg->tape_width;
+			update_preview(NULL, editor);	/* show the real tape */
+		}
+	}
+	g_free(msg->text);
+	g_slice_free(StatusMessage, msg);
+	return G_SOURCE_REMOVE;
+}
+
+/* show a message in the statusbar, may be called from any thread */
+static void status_report(PTouchEditor *editor, int tape_width, const gchar *format, ...)
+{
+	StatusMessage *msg;
+	va_list ap;
+
+	msg=g_slice_new(StatusMessage);
+	msg->editor=editor;
+	msg->tape_width=tape_width;
+	va_start(ap, format);
+	msg->text=g_strdup_vprintf(format, ap);
+	va_end(ap);
+	g_idle_add(status_done, msg);
+}
+
+static int print_label(PTouchEditor *editor, ptouch_dev ptdev, int job, pt_label l)
+{
+	ptouch_buf b;
+	size_t chunk=PRINT_CHUNK*(PT_RASTER_BYTES+3);
+	size_t off, n;
+	int r=0;
+
+	if ((b=ptouch_buf_get(editor->ctx)) == NULL) {
+		return -1;
+	}
+	if ((ptouch_buf_raster(b, l->raster, l->width, PT_RASTER_BYTES) != 0) ||
+	    (ptouch_rasterstart(ptdev) != 0)) {
+		ptouch_buf_free(b);
+		return -1;
+	}
+	for (off=0; off < b->len; off+=n) {
+		n=(b->len-off < chunk)?b->len-off:chunk;
+		if (ptouch_send(ptdev, b->data+off, n) != 0) {
+			r=-1;
+			break;
+		}
+		status_report(editor, 0, "Label %i: %i of %i columns sent",
+			job, (int)((off+n)/(PT_RASTER_BYTES+3)), l->width);
+	}
+	ptouch_buf_free(b);
+	return r;
+}
+
+/* open the printer, render the label for its tape and print it */
+static void print_job(PTouchEditor *editor, RenderRequest *req)
+{
+	ptouch_dev ptdev=NULL;
+	pt_label l;
+	int waiting;
+
+	status_report(editor, 0, "Label %i: opening printer", req->job);
+	if (ptouch_open(editor->ctx, &ptdev) < 0) {
+		status_report(editor, 0, "Label %i: no printer found", req->job);
+		return;
+	}
+	if ((ptouch_init(ptdev) != 0) || (ptouch_getstatus(ptdev) != 0)) {
+		status_report(editor, 0, "Label %i: printer does not respond", req->job);
+		ptouch_close(ptdev);
+		return;
+	}
+	req->tape_width=ptouch_getmaxwidth(ptdev);
+	status_report(editor, req->tape_width, "Label %i: rendering for %imm tape",
+		req->job, ptouch_gettapewidth(ptdev));
+	g_mutex_lock(&editor->render_lock);
+	l=render_label(editor, req);
+	g_mutex_unlock(&editor->render_lock);
+	if (l == NULL) {
+		status_report(editor, 0, "Label %i: nothing to print", req->job);
+	} else if ((print_label(editor, ptdev, req->job, l) != 0) || (ptouch_eject(ptdev) != 0)) {
+		status_report(editor, 0, "Label %i: printing failed", req->job);
+	} else if ((waiting=g_async_queue_length(editor->jobs)) > 0) {
+		status_report(editor, 0, "Label %i printed, %i more queued", req->job, waiting);
+	} else {
+		status_report(editor, 0, "Label %i printed", req->job);
+	}
+	pt_label_free(l);
+	ptouch_close(ptdev);
+}
+
+static gpointer print_thread(gpointer data)
+{
+	PTouchEditor *editor=data;
+	RenderRequest *req;
+
+	while ((req=g_async_queue_pop(editor->jobs)) != &print_quit) {
+		print_job(editor, req);
+		render_request_free(req);
+	}
+	return NULL;
+}
+
+/* snapshot of the entries and fonts */
+static RenderRequest *request_new(PTouchEditor *editor)
+{
+	RenderRequest *req;
+
+	req=g_slice_new0(RenderRequest);
+	req->generation=g_atomic_int_get(&editor->generation);
+	req->tape_width=editor->tape_width;
+	for (int i=0; i<PREVIEW_LINES; i++) {
+		req->text[i]=g_strdup(gtk_entry_get_text(GTK_ENTRY(editor->entry[i])));
+		req->font[i]=font_pattern(editor->fontselect[i]);
+	}
+	return req;
+}
+
+/* the user stopped typing, hand the current state to the renderer */
+static gboolean preview_timeout(gpointer data)
+{
+	PTouchEditor *editor=data;
+	RenderRequest *req;
+
+	editor->preview_timer=0;
+	req=request_new(editor);
+	g_mutex_lock(&editor->lock);
+	render_request_free(editor->request);	/* never started, drop it */
+	editor->request=req;
+	g_cond_signal(&editor->cond);
+	g_mutex_unlock(&editor->lock);
+	return G_SOURCE_REMOVE;
+}
+
+void update_preview(GtkWidget *widget, PTouchEditor *editor)
+{
+	g_atomic_int_inc(&editor->generation);	/* cancel running render */
+	if (editor->preview_timer != 0) {
+		g_source_remove(editor->preview_timer);
+	}
+	editor->preview_timer=g_timeout_add(PREVIEW_DELAY, preview_timeout, editor);
+}
+
+void print_all(GtkWidget *widget, PTouchEditor *editor)
+{
+	RenderRequest *req;
+
+	req=request_new(editor);
+	req->job=++editor->jobs_queued;
+	g_async_queue_push(editor->jobs, req);
+	status_report(editor, 0, "Label %i queued", req->job);
+}
+
 void on_window_destroy(GtkWidget *object, PTouchEditor *editor)
 {
+	if (editor->renderer != NULL) {
+		g_atomic_int_inc(&editor->generation);
+		g_mutex_lock(&editor->lock);
+		editor->quit=TRUE;
+		g_cond_signal(&editor->cond);
+		g_mutex_unlock(&editor->lock);
+		g_thread_join(editor->renderer);
+		editor->renderer=NULL;
+	}
+	if (editor->printer != NULL) {
+		/* a label being printed is finished, queued ones are dropped */
+		g_async_queue_push_front(editor->jobs, &print_quit);
+		g_thread_join(editor->printer);
+		editor->printer=NULL;
+	}
+	for (int i=0; i<PREVIEW_LINES; i++) {
+		line_cache_clear(&editor->line[i]);
+	}
+	pt_font_cleanup(editor->ctx);
 	gtk_main_quit();
 }
 
@@ -59,7 +529,7 @@ gboolean on_window_delete_event(GtkWidget *widget, GdkEvent *event, PTouchEditor
 	return FALSE;   /* propogate event */
 }
 
-void show_about(PTouchEditor *editor)
+void show_about(GtkWidget *widget, PTouchEditor *editor)
 {
 	static const gchar * const authors[] = {
 		"Dominic Radermacher <dominic.radermacher@gmail.com>",
@@ -79,8 +549,9 @@ void show_about(PTouchEditor *editor)
 gboolean init_app(PTouchEditor *editor)
 {
 	GtkBuilder *builder;
-	GError *err=NULL;      
+	GError *err=NULL;
 	guint id;
+	gchar name[16];
 
 	/* use GtkBuilder to build our interface from the XML file */
 	builder = gtk_builder_new();
@@ -90,9 +561,15 @@ gboolean init_app(PTouchEditor *editor)
 		return FALSE;
 	}
 	/* get the widgets which will be referenced in callbacks */
-	editor->window = GTK_WIDGET(gtk_builder_get_object(builder, "window"));
+	editor->window = GTK_WIDGET(gtk_builder_get_object(builder, "editorwindow"));
 	editor->statusbar = GTK_WIDGET(gtk_builder_get_object(builder, "statusbar"));
-	editor->text_view = GTK_WIDGET(gtk_builder_get_object(builder, "text_view"));
+	editor->preview = GTK_WIDGET(gtk_builder_get_object(builder, "preview"));
+	for (int i=0; i<PREVIEW_LINES; i++) {
+		g_snprintf(name, sizeof(name), "entry%i", i+1);
+		editor->entry[i] = GTK_WIDGET(gtk_builder_get_object(builder, name));
+		g_snprintf(name, sizeof(name), "fontselect%i", i+1);
+		editor->fontselect[i] = GTK_WIDGET(gtk_builder_get_object(builder, name));
+	}
 	gtk_builder_connect_signals(builder, editor);
 	/* free memory used by GtkBuilder object */
 	g_object_unref(G_OBJECT(builder));
@@ -101,19 +578,48 @@ gboolean init_app(PTouchEditor *editor)
 	id = gtk_statusbar_get_context_id(GTK_STATUSBAR(editor->statusbar),
 		"PTouch Print GTK+");
 	editor->statusbar_context_id = id;
+	/* start the render and print threads */
+	editor->tape_width=ptouch_tape_px(PREVIEW_TAPE);
+	editor->preview_timer=0;
+	editor->request=NULL;
+	editor->quit=FALSE;
+	editor->generation=0;
+	g_mutex_init(&editor->lock);
+	g_cond_init(&editor->cond);
+	g_mutex_init(&editor->render_lock);
+	if ((editor->ctx=ptouch_ctx_new()) == NULL) {
+		return FALSE;
+	}
+	editor->renderer=g_thread_new("render", render_thread, editor);
+	editor->jobs=g_async_queue_new();
+	editor->jobs_queued=0;
+	editor->printer=g_thread_new("print", print_thread, editor);
 	return TRUE;
 }
 
 int main(int argc, char *argv[])
 {
 	PTouchEditor *editor;
+	RenderRequest *req;
 
-	editor = g_slice_new(PTouchEditor);
+	editor = g_slice_new0(PTouchEditor);
 	gtk_init(&argc, &argv);
 	if (init_app(editor) == FALSE) {
 		return 1;	/* error loading UI */
 	}
 	gtk_widget_show(editor->window);
 	gtk_main();
+	render_request_free(editor->request);
+	while ((req=g_async_queue_try_pop(editor->jobs)) != NULL) {
+		if (req != &print_quit) {
+			render_request_free(req);
+		}
+	}
+	g_async_queue_unref(editor->jobs);
+	g_mutex_clear(&editor->lock);
+	g_mutex_clear(&editor->render_lock);
+	g_cond_clear(&editor->cond);
+	ptouch_ctx_free(editor->ctx);
 	g_slice_free(PTouchEditor, editor);
+	return 0;
 }
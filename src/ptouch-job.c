@@ -0,0 +1,287 @@
+/*
+	ptouch-job - build labels in memory and print them in the background
+
+	Copyright (C) 2015 Dominic Radermacher <dominic.radermacher@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>	/* malloc(), free() */
+#include <string.h>	/* memset(), strdup() */
+#include <errno.h>
+#include <pthread.h>
+#include "config.h"
+#include "gettext.h"	/* gettext(), ngettext() */
+#include "ptouch.h"
+#include "ptouch-render.h"
+#include "ptouch-job.h"
+#include "ptouch-private.h"
+
+#define _(s) gettext(s)
+
+enum { PT_SEG_TEXT, PT_SEG_BITMAP, PT_SEG_CUTMARK };
+
+struct _pt_segment {
+	int type;
+	char *text;		/* PT_SEG_TEXT, split into lines */
+	char *line[PT_JOB_MAX_LINES];
+	int lines;
+	pt_label bitmap;	/* PT_SEG_BITMAP, height as given */
+	struct _pt_segment *next;
+};
+
+struct _ptouch_job {
+	ptouch_ctx ctx;
+	struct _pt_segment *first, *last;
+	ptouch_dev dev;		/* set while submitted */
+	ptouch_buf buf;		/* the rendered label */
+	pthread_t thread;
+	int submitted;
+	int result;		/* of the print thread */
+};
+
+ptouch_job ptouch_job_new(ptouch_ctx ctx)
+{
+	ptouch_job job;
+
+	if ((job=malloc(sizeof(struct _ptouch_job))) == NULL) {
+		return NULL;
+	}
+	memset(job, 0, sizeof(struct _ptouch_job));
+	job->ctx=ctx;
+	return job;
+}
+
+static struct _pt_segment *job_add(ptouch_job job, int type)
+{
+	struct _pt_segment *s;
+
+	if (job->submitted) {
+		return NULL;
+	}
+	if ((s=malloc(sizeof(struct _pt_segment))) == NULL) {
+		return NULL;
+	}
+	memset(s, 0, sizeof(struct _pt_segment));
+	s->type=type;
+	if (job->last != NULL) {
+		job->last->next=s;
+	} else {
+		job->first=s;
+	}
+	job->last=s;
+	return s;
+}
+
+/* add up to PT_JOB_MAX_LINES lines of text, separated by '\n'. With
+   more lines nothing is added, and errno is E2BIG */
+int ptouch_job_add_text(ptouch_job job, const char *text)
+{
+	struct _pt_segment *s;
+	const char *c;
+	char *p;
+	int lines=1;
+
+	for (c=text; (c=strchr(c, '\n')) != NULL; c++) {
+		lines++;
+	}
+	if (lines > PT_JOB_MAX_LINES) {
+		errno=E2BIG;
+		return -1;
+	}
+	if ((p=strdup(text)) == NULL) {
+		return -1;
+	}
+	if ((s=job_add(job, PT_SEG_TEXT)) == NULL) {
+		free(p);
+		return -1;
+	}
+	s->text=p;
+	for (s->lines=0; (p != NULL) && (s->lines < PT_JOB_MAX_LINES); s->lines++) {
+		s->line[s->lines]=p;
+		if ((p=strchr(p, '\n')) != NULL) {
+			*p++='\0';
+		}
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Add a 1 bit bitmap, rows from top to bottom with stride bytes each,
+	the leftmost pixel of a row in the highest bit of its first byte
+	and 1 for black. It is centered across the tape, a bitmap higher
+	than the tape loses the same number of rows at the top and at the
+	bottom.
+   -------------------------------------------------------------------- */
+int ptouch_job_add_bitmap(ptouch_job job, const uint8_t *data, int width, int height, int stride)
+{
+	struct _pt_segment *s;
+	pt_label l;
+
+	if ((width <= 0) || (height <= 0) || (height > PT_RASTER_PX) || (stride*8 < width)) {
+		return -1;
+	}
+	if ((l=pt_label_get(job->ctx, height, width)) == NULL) {
+		return -1;
+	}
+	for (int y=0; y<height; y++, data+=stride) {
+		for (int x=0; x<width; x++) {
+			if (data[x/8] & (0x80 >> (x%8))) {
+				pt_label_setpixel(l, x, y);
+			}
+		}
+	}
+	if ((s=job_add(job, PT_SEG_BITMAP)) == NULL) {
+		pt_label_free(l);
+		return -1;
+	}
+	s->bitmap=l;
+	return 0;
+}
+
+int ptouch_job_add_cutmark(ptouch_job job)
+{
+	return (job_add(job, PT_SEG_CUTMARK) != NULL)?0:-1;
+}
+
+/* place a bitmap centered on a label of the tape height */
+static int job_bitmap(pt_label l, pt_label bm)
+{
+	int x=l->width, top=(l->height-bm->height)/2;
+
+	if (pt_label_resize(l, x+bm->width) != 0) {
+		return -1;
+	}
+	for (int i=0; i<bm->width; i++) {
+		for (int y=0; y<bm->height; y++) {
+			if (pt_label_getpixel(bm, i, y)) {
+				pt_label_setpixel(l, x+i, top+y);
+			}
+		}
+	}
+	return 0;
+}
+
+static pt_label job_render(ptouch_job job, int tape_width)
+{
+	struct _pt_segment *s;
+	int size;
+	pt_label l, t;
+
+	if ((l=pt_label_get(job->ctx, tape_width, 0)) == NULL) {
+		return NULL;
+	}
+	for (s=job->first; s != NULL; s=s->next) {
+		if (s->type == PT_SEG_TEXT) {
+			size=job->ctx->fontsize;
+			t=pt_render_text(job->ctx, job->ctx->font, &size, s->line, s->lines, tape_width);
+			if (t == NULL) {
+				break;
+			}
+			pt_label_append(l, t);
+			pt_label_free(t);
+		} else if (s->type == PT_SEG_BITMAP) {
+			if (job_bitmap(l, s->bitmap) != 0) {
+				break;
+			}
+		} else if (s->type == PT_SEG_CUTMARK) {
+			pt_label_cutmark(l);
+		}
+	}
+	if (s != NULL) {		/* a segment failed */
+		pt_label_free(l);
+		return NULL;
+	}
+	return l;
+}
+
+static void *job_thread(void *data)
+{
+	ptouch_job job=data;
+
+	if ((ptouch_rasterstart(job->dev) != 0) ||
+	    (ptouch_buf_send(job->dev, job->buf) != 0) ||
+	    (ptouch_eject(job->dev) != 0)) {
+		job->result=-1;
+	}
+	return NULL;
+}
+
+/* render the job for the tape in dev and start printing it */
+int ptouch_job_submit(ptouch_job job, ptouch_dev dev)
+{
+	pt_label l;
+	int tape_width;
+
+	if (job->submitted) {
+		return -1;
+	}
+	if ((tape_width=ptouch_getmaxwidth(dev)) <= 0) {
+		fprintf(stderr, _("tape width unknown, call ptouch_getstatus() first\n"));
+		return -1;
+	}
+	if ((l=job_render(job, tape_width)) == NULL) {
+		return -1;
+	}
+	if ((job->buf=ptouch_buf_get(job->ctx)) == NULL) {
+		pt_label_free(l);
+		return -1;
+	}
+	ptouch_buf_raster(job->buf, l->raster, l->width, PT_RASTER_BYTES);
+	job->buf->labels=1;
+	pt_label_free(l);
+	job->dev=dev;
+	job->result=0;
+	if (pthread_create(&job->thread, NULL, job_thread, job) != 0) {
+		ptouch_buf_free(job->buf);
+		job->buf=NULL;
+		return -1;
+	}
+	job->submitted=1;
+	return 0;
+}
+
+/* wait until a submitted job is printed, returns 0 on success */
+int ptouch_job_wait(ptouch_job job)
+{
+	if (!job->submitted) {
+		return -1;
+	}
+	pthread_join(job->thread, NULL);
+	job->submitted=0;
+	ptouch_buf_free(job->buf);
+	job->buf=NULL;
+	job->dev=NULL;
+	return job->result;
+}
+
+void ptouch_job_free(ptouch_job job)
+{
+	struct _pt_segment *s;
+
+	if (job == NULL) {
+		return;
+	}
+	if (job->submitted) {
+		ptouch_job_wait(job);
+	}
+	while ((s=job->first) != NULL) {
+		job->first=s->next;
+		free(s->text);
+		pt_label_free(s->bitmap);
+		free(s);
+	}
+	free(job);
+}
@@ -0,0 +1,175 @@
+/*
+	ptouch-lptest - print through the usblp transport to a stand-in
+
+	Copyright (C) 2015 Dominic Radermacher <dominic.radermacher@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* A pseudo terminal in raw mode stands in for /dev/usb/lp0: it is
+   opened with ptouch_open_lp(), and a thread on the other side answers
+   the status request with a canned 32 byte status of a 12mm tape and
+   records everything else. The recorded commands of a job have to be
+   the same ptouch_open_file() writes for it. Run by "make check". */
+
+#define _GNU_SOURCE	/* posix_openpt(), cfmakeraw() */
+#include <stdio.h>	/* printf() */
+#include <stdlib.h>	/* mkstemp(), free() */
+#include <string.h>	/* memcmp(), memset() */
+#include <fcntl.h>	/* open() */
+#include <unistd.h>	/* read(), write(), close() */
+#include <termios.h>	/* cfmakeraw() */
+#include <pthread.h>
+#include "ptouch.h"
+#include "ptouch-job.h"
+
+#define TAPE_MM 12
+#define SKIP 77		/* automake: the test was skipped */
+#define MAX_DATA (1024*1024)
+
+struct printer {
+	int fd;			/* master side of the pty */
+	uint8_t *data;		/* everything that was sent */
+	size_t len;
+	int answered;		/* status requests answered */
+};
+
+/* the other side of the pty: record the commands, answer ESC i S */
+static void *printer_run(void *arg)
+{
+	struct printer *p=arg;
+	uint8_t status[32];
+	ssize_t n;
+
+	memset(status, 0, sizeof(status));
+	status[0]=0x80;		/* print head mark */
+	status[1]=0x20;		/* size */
+	status[10]=TAPE_MM;	/* media width */
+	status[11]=0x01;	/* laminated tape */
+	while ((p->len < MAX_DATA) && ((n=read(p->fd, p->data+p->len, MAX_DATA-p->len)) > 0)) {
+		p->len+=n;
+		if ((p->answered == 0) && (p->len >= 5) && (memcmp(p->data+2, "\x1b\x69\x53", 3) == 0)) {
+			if (write(p->fd, status, sizeof(status)) != sizeof(status)) {
+				break;
+			}
+			p->answered++;
+		}
+	}
+	return NULL;
+}
+
+/* init, ask for the status and print a job like ptouch-print does */
+static int print_job(ptouch_ctx ctx, ptouch_dev dev)
+{
+	ptouch_job job;
+	int r=0;
+
+	if ((ptouch_init(dev) != 0) || (ptouch_getstatus(dev) != 0)) {
+		return -1;
+	}
+	if ((job=ptouch_job_new(ctx)) == NULL) {
+		return -1;
+	}
+	if ((ptouch_job_add_text(job, "usblp\ntest") != 0) ||
+	    (ptouch_job_add_cutmark(job) != 0) ||
+	    (ptouch_job_submit(job, dev) != 0) ||
+	    (ptouch_job_wait(job) != 0)) {
+		r=-1;
+	}
+	ptouch_job_free(job);
+	return r;
+}
+
+int main(void)
+{
+	struct printer p;
+	struct termios t;
+	pthread_t thread;
+	ptouch_ctx ctx;
+	ptouch_dev dev;
+	char file[]="/tmp/ptouch-lptest.XXXXXX", *pts;
+	uint8_t *ref;
+	ssize_t len;
+	int fd, slave, r=1;
+
+	memset(&p, 0, sizeof(p));
+	if (((p.fd=posix_openpt(O_RDWR|O_NOCTTY)) < 0) || (grantpt(p.fd) != 0) ||
+	    (unlockpt(p.fd) != 0) || ((pts=ptsname(p.fd)) == NULL)) {
+		printf("no pseudo terminal, skipping\n");
+		return SKIP;
+	}
+	/* keep the slave open, so the printer sees no hangup until the end */
+	if ((slave=open(pts, O_RDWR|O_NOCTTY)) < 0) {
+		printf("could not open '%s', skipping\n", pts);
+		return SKIP;
+	}
+	tcgetattr(slave, &t);
+	cfmakeraw(&t);
+	tcsetattr(slave, TCSANOW, &t);
+	if (((p.data=malloc(MAX_DATA)) == NULL) || ((ref=malloc(MAX_DATA)) == NULL)) {
+		return 1;
+	}
+	if ((ctx=ptouch_ctx_new()) == NULL) {
+		return 1;
+	}
+	ptouch_ctx_setfont(ctx, "builtin:5x7");	/* needs no font files */
+	pthread_create(&thread, NULL, printer_run, &p);
+	if (ptouch_open_lp(ctx, &dev, pts, 0) != 0) {
+		printf("ptouch_open_lp('%s') failed\n", pts);
+	} else {
+		if (print_job(ctx, dev) != 0) {
+			printf("printing through the usblp transport failed\n");
+		} else if (ptouch_gettapewidth(dev) != TAPE_MM) {
+			printf("tape width is %imm instead of %imm\n", ptouch_gettapewidth(dev), TAPE_MM);
+		} else {
+			r=0;
+		}
+		ptouch_close(dev);
+	}
+	close(slave);
+	pthread_join(thread, NULL);
+	close(p.fd);
+	/* the same job written to a file, without the status request */
+	if ((fd=mkstemp(file)) < 0) {
+		return 1;
+	}
+	close(fd);
+	if ((r == 0) && (ptouch_open_file(ctx, &dev, file, TAPE_MM) != 0)) {
+		r=1;
+	} else if (r == 0) {
+		if (print_job(ctx, dev) != 0) {
+			printf("printing to '%s' failed\n", file);
+			r=1;
+		}
+		ptouch_close(dev);
+	}
+	if (r == 0) {
+		fd=open(file, O_RDONLY);
+		len=read(fd, ref, MAX_DATA);
+		close(fd);
+		if (p.answered != 1) {
+			printf("the status was requested %i times\n", p.answered);
+			r=1;
+		} else if ((len < 2) || ((size_t)len+3 != p.len) || (memcmp(p.data, ref, 2) != 0) ||
+		    (memcmp(p.data+5, ref+2, len-2) != 0)) {
+			printf("sent %zu bytes, but the file got %zi bytes or other commands\n", p.len, len);
+			r=1;
+		}
+	}
+	unlink(file);
+	ptouch_ctx_free(ctx);
+	free(p.data);
+	free(ref);
+	return r;
+}
@@ -0,0 +1,118 @@
+/*
+	ptouch-pack - pack pixel columns into raster lines
+
+	Copyright (C) 2015 Dominic Radermacher <dominic.radermacher@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* --------------------------------------------------------------------
+	A column of h pixels is printed centered on the print head, pixel
+	y (0 is the top edge) goes to head pixel offset+h-1-y, which is
+	bit (head pixel % 8) of byte 15-(head pixel / 8) of the raster line.
+	For the tape widths in tape_info[] the macros below expand to one
+	kernel each, where all of this is constant and every byte of the
+	raster line is assembled from its 8 pixels without any loop. The
+	cutmark line of each width is a constant as well. Other heights
+	use the generic kernel.
+   -------------------------------------------------------------------- */
+
+#include <string.h>	/* memset() */
+#include "ptouch.h"
+
+#define PACK_OFFSET(h)		(64-(h)/2)
+#define PACK_INSIDE(h, p)	(((p) >= PACK_OFFSET(h)) && ((p) < PACK_OFFSET(h)+(h)))
+
+/* head pixel p, taken from the column px[] */
+#define PACK_PX(h, p)	(PACK_INSIDE(h, p)?(px[PACK_OFFSET(h)+(h)-1-(p)] != 0):0)
+#define PACK_BYTE(h, b)	(uint8_t)( \
+	(PACK_PX(h, (15-(b))*8+0) << 0) | (PACK_PX(h, (15-(b))*8+1) << 1) | \
+	(PACK_PX(h, (15-(b))*8+2) << 2) | (PACK_PX(h, (15-(b))*8+3) << 3) | \
+	(PACK_PX(h, (15-(b))*8+4) << 4) | (PACK_PX(h, (15-(b))*8+5) << 5) | \
+	(PACK_PX(h, (15-(b))*8+6) << 6) | (PACK_PX(h, (15-(b))*8+7) << 7))
+
+/* head pixel p of the cutmark: 4 pixels set, 4 unset, from the bottom */
+#define CUT_PX(h, p)	(PACK_INSIDE(h, p) && ((((p)-PACK_OFFSET(h))%8) <= 3))
+#define CUT_BYTE(h, b)	(uint8_t)( \
+	(CUT_PX(h, (15-(b))*8+0) << 0) | (CUT_PX(h, (15-(b))*8+1) << 1) | \
+	(CUT_PX(h, (15-(b))*8+2) << 2) | (CUT_PX(h, (15-(b))*8+3) << 3) | \
+	(CUT_PX(h, (15-(b))*8+4) << 4) | (CUT_PX(h, (15-(b))*8+5) << 5) | \
+	(CUT_PX(h, (15-(b))*8+6) << 6) | (CUT_PX(h, (15-(b))*8+7) << 7))
+#define CUT_LINE(h)	{ \
+	CUT_BYTE(h, 0), CUT_BYTE(h, 1), CUT_BYTE(h, 2), CUT_BYTE(h, 3), \
+	CUT_BYTE(h, 4), CUT_BYTE(h, 5), CUT_BYTE(h, 6), CUT_BYTE(h, 7), \
+	CUT_BYTE(h, 8), CUT_BYTE(h, 9), CUT_BYTE(h, 10), CUT_BYTE(h, 11), \
+	CUT_BYTE(h, 12), CUT_BYTE(h, 13), CUT_BYTE(h, 14), CUT_BYTE(h, 15) }
+
+#define PACK_KERNEL(h) \
+static void pack_column_##h(uint8_t *line, const uint8_t *px, int height) \
+{ \
+	(void)height; \
+	line[0] |= PACK_BYTE(h, 0);	line[1] |= PACK_BYTE(h, 1); \
+	line[2] |= PACK_BYTE(h, 2);	line[3] |= PACK_BYTE(h, 3); \
+	line[4] |= PACK_BYTE(h, 4);	line[5] |= PACK_BYTE(h, 5); \
+	line[6] |= PACK_BYTE(h, 6);	line[7] |= PACK_BYTE(h, 7); \
+	line[8] |= PACK_BYTE(h, 8);	line[9] |= PACK_BYTE(h, 9); \
+	line[10] |= PACK_BYTE(h, 10);	line[11] |= PACK_BYTE(h, 11); \
+	line[12] |= PACK_BYTE(h, 12);	line[13] |= PACK_BYTE(h, 13); \
+	line[14] |= PACK_BYTE(h, 14);	line[15] |= PACK_BYTE(h, 15); \
+}
+#define PACK_ENTRY(h)	{ h, pack_column_##h, CUT_LINE(h) }
+
+PACK_KERNEL(52)
+PACK_KERNEL(76)
+PACK_KERNEL(120)
+PACK_KERNEL(128)
+
+/* one entry for every width in tape_info[] */
+static const struct _ptouch_pack pack_table[]= {
+	PACK_ENTRY(52),
+	PACK_ENTRY(76),
+	PACK_ENTRY(120),
+	PACK_ENTRY(128),
+	{ 0, NULL, { 0 } }	/* terminating entry */
+};
+
+static void pack_column_generic(uint8_t *line, const uint8_t *px, int height)
+{
+	int offset=64-height/2, pixel;
+
+	for (int y=0; y<height; y++) {
+		if (px[y]) {
+			pixel=offset+height-1-y;
+			line[15-(pixel/8)] |= 1<<(pixel%8);
+		}
+	}
+}
+
+/* pick the kernel for columns of 1 to 128 pixels */
+void ptouch_pack_init(struct _ptouch_pack *k, int height)
+{
+	int offset=64-height/2;
+
+	for (int i=0; pack_table[i].height > 0; i++) {
+		if (pack_table[i].height == height) {
+			*k=pack_table[i];
+			return;
+		}
+	}
+	k->height=height;
+	k->column=pack_column_generic;
+	memset(k->cutmark, 0, sizeof(k->cutmark));
+	for (int i=0; i<height; i++) {
+		if ((i%8) <= 3) {	/* pixels 0-3 get set, 4-7 are unset */
+			k->cutmark[15-((offset+i)/8)] |= 1<<((offset+i)%8);
+		}
+	}
+}
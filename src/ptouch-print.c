@@ -19,79 +19,435 @@
 
 #include <stdio.h>	/* printf() */
 #include <stdlib.h>	/* exit(), malloc() */
-#include <string.h>	/* strcmp(), memcmp() */
+#include <string.h>	/* strcmp(), memcmp(), memset() */
 #include <sys/types.h>	/* open() */
 #include <sys/stat.h>	/* open() */
 #include <fcntl.h>	/* open() */
+#include <unistd.h>	/* fsync() */
+#include <sys/file.h>	/* flock() */
+#include <time.h>	/* time() */
 #include <gd.h>
 #include "config.h"
+#ifdef HAVE_LIBRSVG_2
+#include <librsvg/rsvg.h>
+#endif
 #include "gettext.h"	/* gettext(), ngettext() */
 #include "ptouch.h"
+#include "ptouch-render.h"
+#include "ptouch-template.h"
+#include "ptouch-spool.h"
 
 #define _(s) gettext(s)
 
 #define MAX_LINES 4	/* maybe this should depend on tape size */
+#define MAX_COLUMNS 9	/* data columns for templates, {1}..{9} */
+#define HEAD_DPI 180	/* resolution of the print head */
+#define SVG_MAX_WIDTH 32767	/* the largest cairo image surface */
 
 gdImage *image_load(const char *file);
-void rasterline_setpixel(uint8_t rasterline[16], int pixel);
-int get_baselineoffset(char *text, char *font, int fsz);
-int find_fontsize(int want_px, char *font, char *text);
-int needed_width(char *text, char *font, int fsz);
-int print_img(ptouch_dev ptdev, gdImage *im);
-int write_png(gdImage *im, const char *file);
-gdImage *render_text(char *font, char *line[], int lines, int tape_width);
-void usage(char *progname);
-int parse_args(int argc, char **argv);
+int add_img(pt_label l, gdImage *im);
+int add_img_scaled(pt_label l, gdImage *im, int width, int height, int threshold);
+int add_svg(pt_label l, const char *file, int threshold);
+/* print commands, collected by parse_args() */
+enum { CMD_TEXT, CMD_IMAGE, CMD_CUTMARK, CMD_BARCODE, CMD_QR, CMD_SVG };
+struct _cmd {
+	int type;
+	int lines;
+	char *arg[MAX_LINES];	/* text lines, image file or barcode */
+};
+
+/* everything else from the command line, the font settings go
+   into the ptouch_ctx */
+struct _options {
+	char *save_png;
+	char *save_raw;
+	int copies;
+	char *template_file;
+	char *data_file;
+	int count;
+	int tape_mm;
+	int image_length;	/* scale images to this many columns */
+	int length;		/* label length in mm, 0 for as needed */
+	int threshold;		/* darkness in % that prints black */
+	int info;
+	char *spool_dir;
+	char *metrics_file;
+	char *lp_dev;		/* usblp device instead of libusb */
+	struct _cmd *cmds;
+	int ncmds;
+};
 
-// char *font_file="/usr/share/fonts/TTF/Ubuntu-M.ttf";
-// char *font_file="Ubuntu:medium";
-char *font_file="DejaVuSans";
-char *save_png=NULL;
-int verbose=0;
-int fontsize=0;
+int print_label(ptouch_dev ptdev, pt_spool spool, pt_label l, int copies);
+int print_template(ptouch_ctx ctx, struct _options *opt, ptouch_dev ptdev, pt_spool spool, int tape_width);
+int write_png(pt_label l, const char *file);
+int write_metrics(ptouch_dev ptdev, int ok, const char *file);
+pt_label render_text(ptouch_ctx ctx, char *line[], int lines, int tape_width, int text_width);
+pt_label render_label(ptouch_ctx ctx, struct _options *opt, int tape_width);
+int run(ptouch_ctx ctx, struct _options *opt, pt_spool spool, ptouch_dev *ptdev, int tape_width);
+void usage(char *progname);
+int parse_args(ptouch_ctx ctx, struct _options *opt, int argc, char **argv);
 
 /* --------------------------------------------------------------------
    -------------------------------------------------------------------- */
 
-void rasterline_setpixel(uint8_t rasterline[16], int pixel)
+/* append an image to the label */
+int add_img(pt_label l, gdImage *im)
 {
-	rasterline[15-(pixel/8)] |= 1<<(pixel%8);
-	return;
-}
+	int d,i,k,top,x;
+	uint8_t column[PT_RASTER_PX];
 
-int print_img(ptouch_dev ptdev, gdImage *im)
-{
-	int d,i,k,offset,tape_width;
-	uint8_t rasterline[16];
-
-	tape_width=ptouch_getmaxwidth(ptdev);
 	/* find out whether color 0 or color 1 is darker */
 	d=(gdImageRed(im,1)+gdImageGreen(im,1)+gdImageBlue(im,1) < gdImageRed(im,0)+gdImageGreen(im,0)+gdImageBlue(im,0))?1:0;
-	if (gdImageSY(im) > tape_width) {
+	if (gdImageSY(im) > l->height) {
 		printf(_("image is too large (%ipx x %ipx)\n"), gdImageSX(im), gdImageSY(im));
-		printf(_("maximum printing width for this tape is %ipx\n"), tape_width);
+		printf(_("maximum printing width for this tape is %ipx\n"), l->height);
 		return -1;
 	}
-	offset=64-(gdImageSY(im)/2);	/* always print centered  */
-	if (ptouch_rasterstart(ptdev) != 0) {
-		printf(_("ptouch_rasterstart() failed\n"));
+	/* always print centered, the same way print_img() did */
+	top=(l->height-l->height/2)-(gdImageSY(im)-gdImageSY(im)/2);
+	x=l->width;
+	if (pt_label_resize(l, x+gdImageSX(im)) != 0) {
 		return -1;
 	}
+	memset(column, 0, sizeof(column));
 	for (k=0; k<gdImageSX(im); k+=1) {
-		memset(rasterline, 0, sizeof(rasterline));
 		for (i=0; i<gdImageSY(im); i+=1) {
-			if (gdImageGetPixel(im, k, gdImageSY(im)-1-i) == d) {
-				rasterline_setpixel(rasterline, offset+i);
+			column[top+i]=(gdImageGetPixel(im, k, i) == d);
+		}
+		l->pack.column(pt_label_column(l, x+k), column, l->height);
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Area-average scaling. n input and m output cells are laid on a
+	common axis of n*m units, each input cell is m units and each
+	output cell is n units long. A span is the overlap of one input
+	and one output cell, there are at most n+m of them.
+   -------------------------------------------------------------------- */
+struct span {
+	int src;
+	int dst;
+	uint32_t w;		/* overlap in units */
+};
+
+static int make_spans(struct span *s, int n, int m)
+{
+	uint64_t pos=0, next, src_end, dst_end;
+	int i=0, j=0, k=0;
+
+	while ((i < n) && (j < m)) {
+		src_end=(uint64_t)(i+1)*m;
+		dst_end=(uint64_t)(j+1)*n;
+		next=(src_end < dst_end)?src_end:dst_end;
+		s[k].src=i;
+		s[k].dst=j;
+		s[k].w=next-pos;
+		k++;
+		pos=next;
+		if (next == src_end) {
+			i++;
+		}
+		if (next == dst_end) {
+			j++;
+		}
+	}
+	return k;
+}
+
+/* darkness of image row y, 0 is white or transparent and 255 black */
+static void image_row(gdImage *im, int y, const uint8_t *pal, uint8_t *dark)
+{
+	int x, c, a, lum;
+
+	if (!gdImageTrueColor(im)) {
+		for (x=0; x<gdImageSX(im); x++) {
+			dark[x]=pal[gdImagePalettePixel(im, x, y)];
+		}
+		return;
+	}
+	for (x=0; x<gdImageSX(im); x++) {
+		c=gdImageTrueColorPixel(im, x, y);
+		lum=(gdTrueColorGetRed(c)*77+gdTrueColorGetGreen(c)*150+gdTrueColorGetBlue(c)*29) >> 8;
+		a=gdTrueColorGetAlpha(c);
+		dark[x]=(255-lum)*(gdAlphaMax-a)/gdAlphaMax;
+	}
+}
+
+/* --------------------------------------------------------------------
+	Append an image scaled to width x height px to the label, centered
+	like add_img(). Pixels with a darkness of threshold % or more are
+	black. The image is read one row at a time: each row is
+	converted to darkness, averaged into the output columns and added
+	to the output rows it covers. An output row is thresholded into
+	the label as soon as its last input row is in, so besides the
+	image only one output row of sums is kept.
+   -------------------------------------------------------------------- */
+int add_img_scaled(pt_label l, gdImage *im, int width, int height, int threshold)
+{
+	int sx=gdImageSX(im), sy=gdImageSY(im);
+	struct span *xs, *ys;
+	uint8_t pal[gdMaxColors], *dark;
+	uint32_t *row;
+	uint64_t *acc, black=(uint64_t)255*sx*sy;
+	int nx, ny, x0, top, y, cur, i, k, c;
+
+	if ((width <= 0) || (height <= 0) || (height > l->height)) {
+		return -1;
+	}
+	xs=malloc((sx+width)*sizeof(struct span));
+	ys=malloc((sy+height)*sizeof(struct span));
+	dark=malloc(sx);
+	row=malloc(width*sizeof(uint32_t));
+	acc=calloc(width, sizeof(uint64_t));
+	x0=l->width;
+	if ((xs == NULL) || (ys == NULL) || (dark == NULL) || (row == NULL) ||
+	    (acc == NULL) || (pt_label_resize(l, x0+width) != 0)) {
+		free(xs);
+		free(ys);
+		free(dark);
+		free(row);
+		free(acc);
+		return -1;
+	}
+	for (c=0; c<gdMaxColors; c++) {
+		if (gdImageTrueColor(im) || (c >= gdImageColorsTotal(im))) {
+			pal[c]=0;
+			continue;
+		}
+		k=(gdImageRed(im, c)*77+gdImageGreen(im, c)*150+gdImageBlue(im, c)*29) >> 8;
+		pal[c]=(c == gdImageGetTransparent(im))?0:(255-k)*(gdAlphaMax-gdImageAlpha(im, c))/gdAlphaMax;
+	}
+	nx=make_spans(xs, sx, width);
+	ny=make_spans(ys, sy, height);
+	top=(l->height-l->height/2)-(height-height/2);
+	cur=0;
+	for (k=0, y=0; y<sy; y++) {
+		image_row(im, y, pal, dark);
+		memset(row, 0, width*sizeof(uint32_t));
+		for (i=0; i<nx; i++) {
+			row[xs[i].dst]+=dark[xs[i].src]*xs[i].w;
+		}
+		for (; (k < ny) && (ys[k].src == y); k++) {
+			if (ys[k].dst != cur) {		/* output row cur is done */
+				for (i=0; i<width; i++) {
+					if (acc[i]*100 >= black*threshold) {
+						pt_label_setpixel(l, x0+i, top+cur);
+					}
+				}
+				memset(acc, 0, width*sizeof(uint64_t));
+				cur=ys[k].dst;
+			}
+			for (i=0; i<width; i++) {
+				acc[i]+=(uint64_t)row[i]*ys[k].w;
 			}
 		}
-		if (ptouch_sendraster(ptdev, rasterline, 16) != 0) {
-			printf(_("ptouch_send() failed\n"));
-			return -1;
+	}
+	for (i=0; i<width; i++) {
+		if (acc[i]*100 >= black*threshold) {
+			pt_label_setpixel(l, x0+i, top+cur);
 		}
 	}
+	free(xs);
+	free(ys);
+	free(dark);
+	free(row);
+	free(acc);
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	The label already is in raster line format, so it is encoded only
+	once and then sent for every copy. All copies are chained in one
+	job: they are separated by a cutmark, and only the last one is fed
+	and cut.
+   -------------------------------------------------------------------- */
+static ptouch_buf make_separator(ptouch_dev ptdev, int height)
+{
+	ptouch_buf sep;
+	pt_label cut;
+
+	if ((sep=ptouch_buf_get(ptouch_dev_ctx(ptdev))) == NULL) {
+		return NULL;
+	}
+	if ((cut=pt_label_get(ptouch_dev_ctx(ptdev), height, 0)) == NULL) {
+		ptouch_buf_free(sep);
+		return NULL;
+	}
+	pt_label_cutmark(cut);
+	ptouch_buf_raster(sep, cut->raster, cut->width, PT_RASTER_BYTES);
+	pt_label_free(cut);
+	return sep;
+}
+
+/* append the commands of b to chain */
+static int buf_append(ptouch_buf chain, ptouch_buf b)
+{
+	if (ptouch_buf_add(chain, b->data, b->len) != 0) {
+		return -1;
+	}
+	chain->lines+=b->lines;
+	chain->labels+=b->labels;
 	return 0;
 }
 
+/* send a cutmark separator (if sep is not NULL) and a label to the
+   printer, or queue both in the spool as one job, so a job that is
+   printed again after a crash is never a separator without its label */
+static int send_buf(ptouch_dev ptdev, pt_spool spool, ptouch_buf sep, ptouch_buf b, int tape_width)
+{
+	ptouch_buf chain;
+	int r=0;
+
+	if (spool == NULL) {
+		if ((sep != NULL) && (ptouch_buf_send(ptdev, sep) != 0)) {
+			return -1;
+		}
+		return ptouch_buf_send(ptdev, b);
+	}
+	if (sep == NULL) {
+		return pt_spool_add(spool, b, tape_width);
+	}
+	if ((chain=ptouch_buf_get(ptouch_dev_ctx(ptdev))) == NULL) {
+		return -1;
+	}
+	if ((buf_append(chain, sep) != 0) || (buf_append(chain, b) != 0) ||
+	    (pt_spool_add(spool, chain, tape_width) != 0)) {
+		r=-1;
+	}
+	ptouch_buf_free(chain);
+	return r;
+}
+
+int print_label(ptouch_dev ptdev, pt_spool spool, pt_label l, int copies)
+{
+	ptouch_buf lbl, sep=NULL, chain=NULL;
+	int r=0;
+
+	lbl=ptouch_buf_get(ptouch_dev_ctx(ptdev));
+	if ((copies > 1) && (lbl != NULL)) {
+		sep=make_separator(ptdev, l->height);
+	}
+	if ((lbl == NULL) || ((copies > 1) && (sep == NULL))) {
+		ptouch_buf_free(lbl);
+		ptouch_buf_free(sep);
+		return -1;
+	}
+	ptouch_buf_raster(lbl, l->raster, l->width, PT_RASTER_BYTES);
+	lbl->labels=1;
+	if (spool != NULL) {
+		/* the whole chain is one spooled job */
+		if ((chain=ptouch_buf_get(ptouch_dev_ctx(ptdev))) == NULL) {
+			r=-1;
+		}
+		for (int i=0; (r == 0) && (i < copies); i++) {
+			if ((buf_append(chain, lbl) != 0) ||
+			    ((i+1 < copies) && (buf_append(chain, sep) != 0))) {
+				r=-1;
+			}
+		}
+		if ((r == 0) && (pt_spool_add(spool, chain, l->height) != 0)) {
+			r=-1;
+		}
+		if (r != 0) {
+			printf(_("could not spool the label\n"));
+		}
+		ptouch_buf_free(chain);
+	} else if (ptouch_rasterstart(ptdev) != 0) {
+		printf(_("ptouch_rasterstart() failed\n"));
+		r=-1;
+	} else {
+		for (int i=0; (r == 0) && (i < copies); i++) {
+			if (send_buf(ptdev, NULL, (i > 0)?sep:NULL, lbl, l->height) != 0) {
+				printf(_("ptouch_send() failed\n"));
+				r=-1;
+			}
+		}
+	}
+	ptouch_buf_free(lbl);
+	ptouch_buf_free(sep);
+	return r;
+}
+
+/* split a line of template data at tabs, or at commas if it has none */
+static int split_columns(char *line, char *col[], int max)
+{
+	char sep=(strchr(line, '\t') != NULL)?'\t':',';
+	int n=0;
+
+	line[strcspn(line, "\r\n")]='\0';
+	while (n < max) {
+		col[n++]=line;
+		if ((line=strchr(line, sep)) == NULL) {
+			break;
+		}
+		*line++='\0';
+	}
+	return n;
+}
+
+/* --------------------------------------------------------------------
+	Print count labels from a template, or one label per line of the
+	data file. Only the first label is written to the png file. With
+	ptdev NULL nothing is printed.
+   -------------------------------------------------------------------- */
+int print_template(ptouch_ctx ctx, struct _options *opt, ptouch_dev ptdev, pt_spool spool, int tape_width)
+{
+	pt_template t;
+	ptouch_buf sep=NULL;
+	FILE *df=NULL;
+	char line[1024], *col[MAX_COLUMNS];
+	int n, cols=0, r=0;
+
+	if ((t=pt_template_load(ctx, opt->template_file, tape_width)) == NULL) {
+		return -1;
+	}
+	if ((opt->data_file != NULL) && ((df=fopen(opt->data_file, "r")) == NULL)) {
+		printf(_("could not open data file '%s'\n"), opt->data_file);
+		pt_template_free(t);
+		return -1;
+	}
+	if ((ptdev != NULL) && (spool == NULL) && (ptouch_rasterstart(ptdev) != 0)) {
+		printf(_("ptouch_rasterstart() failed\n"));
+		r=-1;
+	}
+	for (n=0; (r == 0) && ((opt->count == 0) || (n < opt->count)); n++) {
+		if (df != NULL) {
+			if (fgets(line, sizeof(line), df) == NULL) {
+				break;
+			}
+			cols=split_columns(line, col, MAX_COLUMNS);
+		} else if ((opt->count == 0) && (n > 0)) {
+			break;		/* just one label */
+		}
+		if (pt_template_next(t, col, cols) != 0) {
+			printf(_("could not render label %i\n"), n+1);
+			r=-1;
+			break;
+		}
+		if ((n == 0) && (opt->save_png != NULL)) {
+			write_png(t->label, opt->save_png);
+		}
+		if (ptdev == NULL) {
+			break;
+		}
+		if ((n == 1) && ((sep=make_separator(ptdev, tape_width)) == NULL)) {
+			r=-1;
+			break;
+		}
+		if (send_buf(ptdev, spool, (n > 0)?sep:NULL, t->buf, tape_width) != 0) {
+			printf(_("ptouch_send() failed\n"));
+			r=-1;
+		}
+	}
+	if (df != NULL) {
+		fclose(df);
+	}
+	ptouch_buf_free(sep);
+	pt_template_free(t);
+	return r;
+}
+
 /* --------------------------------------------------------------------
 	Function	image_load()
 	Description	detect the type of a image and try to load it
@@ -120,119 +476,413 @@ gdImage *image_load(const char *file)
 	return img;
 }
 
-int write_png(gdImage *im, const char *file)
+/* --------------------------------------------------------------------
+	Counters are kept across runs: the values in the metrics file of
+	the last run are read back and added to, so they never go down and
+	runs between two scrapes are not lost. The file is locked while
+	doing so, as runs may end at the same time.
+   -------------------------------------------------------------------- */
+
+/* value of a sample in the last metrics file, 0 if it is not there */
+static double metrics_prev(const char *prev, const char *key)
+{
+	size_t n=strlen(key);
+
+	while ((prev != NULL) && (*prev != '\0')) {
+		if ((strncmp(prev, key, n) == 0) && (prev[n] == ' ')) {
+			return strtod(prev+n+1, NULL);
+		}
+		if ((prev=strchr(prev, '\n')) != NULL) {
+			prev++;
+		}
+	}
+	return 0;
+}
+
+/* the whole file, or NULL if there is none yet */
+static char *metrics_load(const char *file)
 {
+	struct stat st;
+	char *buf;
 	FILE *f;
+	size_t n;
+
+	if ((f=fopen(file, "r")) == NULL) {
+		return NULL;
+	}
+	if ((fstat(fileno(f), &st) != 0) || ((buf=malloc(st.st_size+1)) == NULL)) {
+		fclose(f);
+		return NULL;
+	}
+	n=fread(buf, 1, st.st_size, f);
+	buf[n]='\0';
+	fclose(f);
+	return buf;
+}
+
+static void metrics_hist(FILE *f, const char *prev, const char *name, const char *help, const struct _ptouch_hist *h)
+{
+	char key[128];
+	uint64_t n=0;
+
+	fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	for (int i=0; i<PT_HIST_BUCKETS; i++) {
+		n+=h->bucket[i];
+		snprintf(key, sizeof(key), "%s_bucket{le=\"%g\"}", name, ptouch_hist_le[i]);
+		fprintf(f, "%s %llu\n", key, (unsigned long long)(n+metrics_prev(prev, key)));
+	}
+	snprintf(key, sizeof(key), "%s_bucket{le=\"+Inf\"}", name);
+	fprintf(f, "%s %llu\n", key, (unsigned long long)(h->count+metrics_prev(prev, key)));
+	snprintf(key, sizeof(key), "%s_sum", name);
+	fprintf(f, "%s %.6f\n", key, h->sum+metrics_prev(prev, key));
+	snprintf(key, sizeof(key), "%s_count", name);
+	fprintf(f, "%s %llu\n", key, (unsigned long long)(h->count+metrics_prev(prev, key)));
+}
 
+static void metrics_counter(FILE *f, const char *prev, const char *name, const char *help, uint64_t v)
+{
+	fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name,
+		(unsigned long long)(v+metrics_prev(prev, name)));
+}
+
+/* --------------------------------------------------------------------
+	Write the statistics in the Prometheus text format, the counters
+	include all earlier runs. The file is written under a temporary
+	name and renamed, so the node_exporter textfile collector never
+	sees a partial file.
+   -------------------------------------------------------------------- */
+int write_metrics(ptouch_dev ptdev, int ok, const char *file)
+{
+	const struct _ptouch_stats *st;
+	struct _ptouch_stats none;
+	char tmp[4096], key[128], *prev;
+	FILE *f;
+	int r, lock;
+
+	memset(&none, 0, sizeof(none));
+	st=(ptdev != NULL)?ptouch_getstats(ptdev):&none;
+	snprintf(tmp, sizeof(tmp), "%s.lock", file);
+	if (((lock=open(tmp, O_RDWR|O_CREAT, 0644)) < 0) || (flock(lock, LOCK_EX) != 0)) {
+		printf(_("could not lock metrics file '%s'\n"), tmp);
+		if (lock >= 0) {
+			close(lock);
+		}
+		return -1;
+	}
+	prev=metrics_load(file);
+	snprintf(tmp, sizeof(tmp), "%s.%i.tmp", file, (int)getpid());
+	if ((f=fopen(tmp, "w")) == NULL) {
+		printf(_("could not write metrics file '%s'\n"), tmp);
+		free(prev);
+		close(lock);
+		return -1;
+	}
+	metrics_counter(f, prev, "ptouch_labels_printed_total", "Labels sent to the printer.", st->labels);
+	metrics_counter(f, prev, "ptouch_raster_lines_total", "Raster lines sent to the printer.", st->lines);
+	metrics_counter(f, prev, "ptouch_bytes_sent_total", "Bytes sent to the printer.", st->bytes);
+	metrics_counter(f, prev, "ptouch_pool_misses_total", "Allocations for label bitmaps and command buffers the pool could not serve.",
+		(ptdev != NULL)?ptouch_pool_misses(ptouch_dev_ctx(ptdev)):0);
+	metrics_hist(f, prev, "ptouch_transfer_duration_seconds", "Duration of transfers to the printer.", &st->transfer);
+	metrics_hist(f, prev, "ptouch_status_request_duration_seconds", "Duration of status requests.", &st->status);
+	metrics_counter(f, prev, "ptouch_status_failures_total", "Status requests without a valid answer.", st->status_failed);
+	fprintf(f, "# HELP ptouch_status_error_bits_total Status answers with this error bit set.\n");
+	fprintf(f, "# TYPE ptouch_status_error_bits_total counter\n");
+	for (int i=0; i<2; i++) {
+		for (int k=0; k<8; k++) {
+			snprintf(key, sizeof(key), "ptouch_status_error_bits_total{error=\"%i\",bit=\"%i\"}", i+1, k);
+			fprintf(f, "%s %llu\n", key, (unsigned long long)(st->error[i][k]+metrics_prev(prev, key)));
+		}
+	}
+	metrics_counter(f, prev, "ptouch_unknown_tape_total", "Status answers with an unknown tape width.", st->unknown_tape);
+	fprintf(f, "# HELP ptouch_last_run_success Whether the last run succeeded.\n");
+	fprintf(f, "# TYPE ptouch_last_run_success gauge\nptouch_last_run_success %i\n", ok?1:0);
+	fprintf(f, "# HELP ptouch_last_run_timestamp_seconds When the last run ended.\n");
+	fprintf(f, "# TYPE ptouch_last_run_timestamp_seconds gauge\nptouch_last_run_timestamp_seconds %lld\n", (long long)time(NULL));
+	free(prev);
+	r=(fflush(f) != 0) || (fsync(fileno(f)) != 0) || ferror(f);
+	if ((fclose(f) != 0) || r || (rename(tmp, file) != 0)) {
+		printf(_("could not write metrics file '%s'\n"), file);
+		unlink(tmp);
+		close(lock);
+		return -1;
+	}
+	close(lock);	/* releases the lock */
+	return 0;
+}
+
+int write_png(pt_label l, const char *file)
+{
+	FILE *f;
+	gdImage *im;
+	int x, y, black;
+
+	if ((im=gdImageCreatePalette(l->width, l->height)) == NULL) {
+		return -1;
+	}
+	gdImageColorAllocate(im, 255, 255, 255);
+	black=gdImageColorAllocate(im, 0, 0, 0);
+	for (x=0; x<l->width; x++) {
+		for (y=0; y<l->height; y++) {
+			if (pt_label_getpixel(l, x, y)) {
+				gdImageSetPixel(im, x, y, black);
+			}
+		}
+	}
 	if ((f = fopen(file, "wb")) == NULL) {
 		printf(_("writing image '%s' failed\n"), file);
+		gdImageDestroy(im);
 		return -1;
 	}
 	gdImagePng(im, f);
 	fclose(f);
+	gdImageDestroy(im);
 	return 0;
 }
 
-/* --------------------------------------------------------------------
-	Find out the difference in pixels between a "normal" char and one
-	that goes below the font baseline
-   -------------------------------------------------------------------- */
-int get_baselineoffset(char *text, char *font, int fsz)
+/* text_width > 0 limits the width of the text when fitting it */
+pt_label render_text(ptouch_ctx ctx, char *line[], int lines, int tape_width, int text_width)
+{
+	pt_label l;
+	int fsz=ptouch_ctx_fontsize(ctx);
+
+//	printf(_("%i lines, font = '%s'\n"), lines, ptouch_ctx_font(ctx));
+	if (fsz > 0) {
+		printf(_("setting font size=%i\n"), fsz);
+	}
+	if ((l=pt_render_text_len(ctx, ptouch_ctx_font(ctx), &fsz, line, lines, tape_width, text_width)) == NULL) {
+		return NULL;
+	}
+	if (ptouch_ctx_fontsize(ctx) == 0) {
+		printf(_("choosing font size=%i\n"), fsz);
+	}
+	return l;
+}
+
+/* fit an image to the tape height, or to a fixed length if given */
+static int scale_img(pt_label l, gdImage *im, const char *file, int length, int threshold)
 {
-	int brect[8];
-
-	if (strpbrk(text, "QgjpqyQ") == NULL) {	/* if we have none of these */
-		return 0;		/* we don't need an baseline offset */
-	}				/* else we need to calculate it */
-	gdImageStringFT(NULL, &brect[0], -1, font, fsz, 0.0, 0, 0, "o");
-	int tmp=brect[1]-brect[5];
-	gdImageStringFT(NULL, &brect[0], -1, font, fsz, 0.0, 0, 0, "g");
-	return (brect[1]-brect[5])-tmp;
+	int height=gdImageSY(im), width=gdImageSX(im);
+
+	if (height > l->height) {
+		height=l->height;
+		width=((long)gdImageSX(im)*height+gdImageSY(im)/2)/gdImageSY(im);
+	}
+	if (length > 0) {
+		width=length;
+	}
+	if (width < 1) {
+		width=1;
+	}
+	printf(_("scaling image '%s' from %ipx x %ipx to %ipx x %ipx\n"),
+		file, gdImageSX(im), gdImageSY(im), width, height);
+	return add_img_scaled(l, im, width, height, threshold);
 }
 
 /* --------------------------------------------------------------------
-	Find out which fontsize we need for a given font to get a
-	specified pixel size
+	Rasterize an SVG at the print head resolution, scaled to the full
+	tape height, and threshold it into the label. Transparent parts
+	count as white.
    -------------------------------------------------------------------- */
-int find_fontsize(int want_px, char *font, char *text)
+#ifdef HAVE_LIBRSVG_2
+int add_svg(pt_label l, const char *file, int threshold)
 {
-	int save=0;
-	int brect[8];
+	RsvgHandle *svg;
+	RsvgRectangle vp;
+	GError *err=NULL;
+	cairo_surface_t *cs;
+	cairo_t *cr;
+	gdouble w, h;
+	uint8_t column[PT_RASTER_PX], *data;
+	uint32_t p;
+	int width, height=l->height, stride, x0=l->width, x, y, r, dark;
 
-	for (int i=4; ; i++) {
-		if (gdImageStringFT(NULL, &brect[0], -1, font, i, 0.0, 0, 0, text) != NULL) {
-			break;
+	if ((svg=rsvg_handle_new_from_file(file, &err)) == NULL) {
+		printf(_("could not load svg '%s': %s\n"), file, err->message);
+		g_error_free(err);
+		return -1;
+	}
+	rsvg_handle_set_dpi(svg, HEAD_DPI);
+	if (!rsvg_handle_get_intrinsic_size_in_pixels(svg, &w, &h) || (w <= 0) || (h <= 0)) {
+		printf(_("svg '%s' has no size\n"), file);
+		g_object_unref(svg);
+		return -1;
+	}
+	if (w*height/h > SVG_MAX_WIDTH) {
+		printf(_("svg '%s' is too long for the tape\n"), file);
+		g_object_unref(svg);
+		return -1;
+	}
+	if ((width=(int)(w*height/h+0.5)) < 1) {
+		width=1;
+	}
+	cs=cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+	if (cairo_surface_status(cs) != CAIRO_STATUS_SUCCESS) {
+		printf(_("could not render svg '%s': %s\n"), file, cairo_status_to_string(cairo_surface_status(cs)));
+		cairo_surface_destroy(cs);
+		g_object_unref(svg);
+		return -1;
+	}
+	cr=cairo_create(cs);
+	vp.x=0;
+	vp.y=0;
+	vp.width=width;
+	vp.height=height;
+	if (!rsvg_handle_render_document(svg, cr, &vp, &err)) {
+		printf(_("could not render svg '%s': %s\n"), file, err->message);
+		g_error_free(err);
+		r=-1;
+	} else if (cairo_status(cr) != CAIRO_STATUS_SUCCESS) {
+		printf(_("could not render svg '%s': %s\n"), file, cairo_status_to_string(cairo_status(cr)));
+		r=-1;
+	} else {
+		r=0;
+	}
+	cairo_destroy(cr);
+	g_object_unref(svg);
+	cairo_surface_flush(cs);
+	if ((r == 0) && ((data=cairo_image_surface_get_data(cs)) == NULL)) {
+		r=-1;
+	}
+	if ((r != 0) || (pt_label_resize(l, x0+width) != 0)) {
+		cairo_surface_destroy(cs);
+		return -1;
+	}
+	stride=cairo_image_surface_get_stride(cs);
+	for (x=0; x<width; x++) {
+		for (y=0; y<height; y++) {
+			/* premultiplied ARGB, on white the darkness is
+			   alpha minus the (premultiplied) luminance */
+			p=*(uint32_t *)(data+y*stride+x*4);
+			dark=(p >> 24)-((((p >> 16) & 0xff)*77+((p >> 8) & 0xff)*150+(p & 0xff)*29) >> 8);
+			column[y]=(dark*100 >= threshold*255);
 		}
-		if (brect[1]-brect[5] <= want_px) {
-			save=i;
+		l->pack.column(pt_label_column(l, x0+x), column, height);
+	}
+	cairo_surface_destroy(cs);
+	return 0;
+}
+#else
+int add_svg(pt_label l, const char *file, int threshold)
+{
+	printf(_("this ptouch-print was built without svg support\n"));
+	return -1;
+}
+#endif
+
+/* render one print command into a label of its own */
+static pt_label render_cmd(ptouch_ctx ctx, struct _options *opt, struct _cmd *cmd, int tape_width, int text_width)
+{
+	pt_label l;
+	gdImage *im;
+	int r=0;
+
+	if (cmd->type == CMD_TEXT) {
+		if ((l=render_text(ctx, cmd->arg, cmd->lines, tape_width, text_width)) == NULL) {
+			printf(_("could not render text\n"));
+		}
+		return l;
+	}
+	if ((l=pt_label_get(ctx, tape_width, 0)) == NULL) {
+		return NULL;
+	}
+	if (cmd->type == CMD_IMAGE) {
+		if ((im=image_load(cmd->arg[0])) == NULL) {
+			printf(_("could not load image '%s'\n"), cmd->arg[0]);
+			r=-1;
+		} else if ((gdImageSY(im) > tape_width) || (opt->image_length > 0)) {
+			r=scale_img(l, im, cmd->arg[0], opt->image_length, opt->threshold);
 		} else {
-			break;
+			r=add_img(l, im);
 		}
+		if (im != NULL) {
+			gdImageDestroy(im);
+		}
+	} else if (cmd->type == CMD_SVG) {
+		r=add_svg(l, cmd->arg[0], opt->threshold);
+	} else if (cmd->type == CMD_CUTMARK) {
+		pt_label_cutmark(l);
+	} else if (cmd->type == CMD_BARCODE) {
+		r=pt_barcode_code128(l, cmd->arg[1]);
+	} else if (cmd->type == CMD_QR) {
+		r=pt_barcode_qr(l, cmd->arg[0]);
 	}
-	if (save == 0) {
-		return -1;
+	if (r != 0) {
+		pt_label_free(l);
+		return NULL;
 	}
-	return save;
+	return l;
 }
 
-int needed_width(char *text, char *font, int fsz)
+static void free_parts(pt_label *part, int n)
 {
-	int brect[8];
-
-	if (gdImageStringFT(NULL, &brect[0], -1, font, fsz, 0.0, 0, 0, text) != NULL) {
-		return -1;
+	for (int i=0; i<n; i++) {
+		pt_label_free(part[i]);
 	}
-	return brect[2]-brect[0];
+	free(part);
 }
 
-gdImage *render_text(char *font, char *line[], int lines, int tape_width)
+/* --------------------------------------------------------------------
+	Render all print commands into one label. With --length, everything
+	but text is rendered first and the text commands share the columns
+	that are left, each gets the biggest font size that fits into its
+	share and the tape height. The label is then centered on exactly
+	that many columns.
+   -------------------------------------------------------------------- */
+pt_label render_label(ptouch_ctx ctx, struct _options *opt, int tape_width)
 {
-	int brect[8];
-	int i, black, x=0, tmp, fsz=0, ofs;
-	char *p;
-	gdImage *im=NULL;
+	pt_label l, *part;
+	int i, width=0, texts=0, text_width=0, length=0, pad=0;
 
-//	printf(_("%i lines, font = '%s'\n"), lines, font);
-	if (gdFTUseFontConfig(1) != GD_TRUE) {
-		printf(_("warning: font config not available\n"));
+	if ((part=calloc(opt->ncmds+1, sizeof(pt_label))) == NULL) {
+		return NULL;
 	}
-	if (fontsize > 0) {
-		fsz=fontsize;
-		printf(_("setting font size=%i\n"), fsz);
-	} else {
-		for (i=0; i<lines; i++) {
-			if ((tmp=find_fontsize(tape_width/lines, font, line[i])) < 0) {
-				printf(_("could not estimate needed font size\n"));
-				return NULL;
-			}
-			if ((fsz == 0) || (tmp < fsz)) {
-				fsz=tmp;
-			}
+	for (i=0; i<opt->ncmds; i++) {
+		if (opt->cmds[i].type == CMD_TEXT) {
+			texts++;
+		} else if ((part[i]=render_cmd(ctx, opt, &opt->cmds[i], tape_width, 0)) == NULL) {
+			free_parts(part, opt->ncmds);
+			return NULL;
+		} else {
+			width+=part[i]->width;
 		}
-		printf(_("choosing font size=%i\n"), fsz);
 	}
-	for(i=0; i<lines; i++) {
-		tmp=needed_width(line[i], font_file, fsz);
-		if (tmp > x) {
-			x=tmp;
+	if (opt->length > 0) {
+		length=(int)(opt->length*HEAD_DPI/25.4+0.5);
+		if ((texts > 0) && ((text_width=(length-width)/texts) < 1)) {
+			printf(_("no room left for text on a %imm label\n"), opt->length);
+			free_parts(part, opt->ncmds);
+			return NULL;
 		}
 	}
-	im=gdImageCreatePalette(x, tape_width);
-	gdImageColorAllocate(im, 255, 255, 255);
-	black=gdImageColorAllocate(im, 0, 0, 0);
-	/* gdImageStringFT(im,brect,fg,fontlist,size,angle,x,y,string) */
-	for (i=0; i<lines; i++) {
-		if ((p=gdImageStringFT(NULL, &brect[0], -black, font, fsz, 0.0, 0, 0, line[i])) != NULL) {
-			printf(_("error in gdImageStringFT: %s\n"), p);
+	for (i=0; i<opt->ncmds; i++) {
+		if (opt->cmds[i].type != CMD_TEXT) {
+			continue;
+		}
+		if ((part[i]=render_cmd(ctx, opt, &opt->cmds[i], tape_width, text_width)) == NULL) {
+			free_parts(part, opt->ncmds);
+			return NULL;
+		}
+		width+=part[i]->width;
+	}
+	if (length > 0) {
+		if (width > length) {
+			printf(_("label needs %i columns, but %imm are only %i\n"), width, opt->length, length);
+			free_parts(part, opt->ncmds);
+			return NULL;
+		}
+		pad=(length-width)/2;
+	}
+	if ((l=pt_label_get(ctx, tape_width, pad)) != NULL) {
+		for (i=0; i<opt->ncmds; i++) {
+			pt_label_append(l, part[i]);
 		}
-		tmp=brect[1]-brect[5];
-		ofs=get_baselineoffset(line[i], font_file, fsz);
-//		printf("line %i height = %ipx, pos = %i\n", i+1, tmp, i*(tape_width/lines)+tmp-ofs-1);
-		if ((p=gdImageStringFT(im, &brect[0], -black, font, fsz, 0.0, 0, i*(tape_width/lines)+tmp-ofs-1, line[i])) != NULL) {
-			printf(_("error in gdImageStringFT: %s\n"), p);
+		if ((length > 0) && (pt_label_resize(l, length) != 0)) {
+			pt_label_free(l);
+			l=NULL;
 		}
 	}
-	return im;
+	free_parts(part, opt->ncmds);
+	return l;
 }
 
 void usage(char *progname)
@@ -240,21 +890,55 @@ void usage(char *progname)
 	printf("usage: %s [options] <print-command(s)>\n", progname);
 	printf("options:\n");
 	printf("\t--font <file>\t\tuse font <file> or <name>\n");
+	printf("\t\t\t\tbuiltin:5x7, builtin:10x14 and their bold\n\t\t\t\tvariants (builtin:5x7bold, builtin:10x14bold)\n\t\t\t\tare bitmap fonts that need no font files\n");
+	printf("\t--fontsize <size>\tuse this font size instead of fitting\n\t\t\t\tthe text to the tape\n");
+	printf("\t--tape <mm>\t\tassume this tape width instead of asking\n\t\t\t\tthe printer\n");
 	printf("\t--writepng <file>\tinstead of printing, write output to png file\n");
-	printf("\t\t\t\tThis currently works only when using\n\t\t\t\tEXACTLY ONE --text statement\n");
+	printf("\t--writeraw <file>\tinstead of printing, write the printer\n\t\t\t\tcommands to <file> (- is stdout)\n");
+	printf("\t\t\t\t--writepng and --writeraw need no printer\n\t\t\t\twhen --tape is given\n");
+	printf("\t--lp <device>\t\tprint through a usblp device like\n\t\t\t\t/dev/usb/lp0 instead of libusb\n");
+	printf("\t--copies <n>\t\tprint <n> copies of the label in one go\n");
+	printf("\t--template <file>\tprint labels from a template file instead\n\t\t\t\tof print-commands\n");
+	printf("\t--data <file>\t\tone label per line, tab or comma separated\n\t\t\t\tcolumns fill the template fields\n");
+	printf("\t--count <n>\t\tprint <n> labels from the template\n");
+	printf("\t--spool <dir>\t\tqueue the labels in <dir> first and resume\n\t\t\t\tunfinished labels from an earlier run\n");
+	printf("\t--metrics <file>\twrite statistics in Prometheus text format\n\t\t\t\tto <file>, e.g. for node_exporter\n");
+	printf("\t--length <mm>\t\tmake the label exactly <mm> long, text is\n\t\t\t\tfitted into the room the rest leaves\n");
+	printf("\t--imagelength <px>\tscale images to <px> columns along the tape\n");
+	printf("\t--threshold <percent>\tdarkness from which scaled images and svgs\n\t\t\t\tprint black, default 50\n");
+	printf("\t--info\t\t\tshow the maximum printing width of the tape\n");
 	printf("print-commands:\n");
 	printf("\t--image <file>\t\tprint the given image which must be a 2 color\n");
-	printf("\t\t\t\t(black/white) png\n");
+	printf("\t\t\t\t(black/white) png, images higher than the tape\n\t\t\t\tare scaled down to fit\n");
+	printf("\t--svg <file>\t\tprint an svg scaled to the tape height\n");
 	printf("\t--text <text>\t\tPrint 1-4 lines of text.\n");
 	printf("\t\t\t\tIf the text contains spaces, use quotation marks\n\t\t\t\taround it.\n");
 	printf("\t--cutmark\t\tPrint a mark where the tape should be cut\n");
+	printf("\t--barcode <type> <data>\tPrint a barcode, <type> can be code128\n");
+	printf("\t--qr <data>\t\tPrint a QR code\n");
 	exit(1);
 }
 
-/* here we don't print anything, but just try to catch syntax errors */
-int parse_args(int argc, char **argv)
+static struct _cmd *add_cmd(struct _options *opt, int type)
+{
+	struct _cmd *p;
+
+	if ((p=realloc(opt->cmds, (opt->ncmds+1)*sizeof(struct _cmd))) == NULL) {
+		printf(_("out of memory\n"));
+		exit(1);
+	}
+	opt->cmds=p;
+	p=&opt->cmds[opt->ncmds++];
+	memset(p, 0, sizeof(struct _cmd));
+	p->type=type;
+	return p;
+}
+
+/* here we don't print anything, but collect settings and print commands */
+int parse_args(ptouch_ctx ctx, struct _options *opt, int argc, char **argv)
 {
 	int lines, i;
+	struct _cmd *c;
 
 	for (i=1; i<argc; i++) {
 		if (*argv[i] != '-') {
@@ -262,39 +946,162 @@ int parse_args(int argc, char **argv)
 		}
 		if (strcmp(&argv[i][1], "-font") == 0) {
 			if (i+1<argc) {
-				font_file=argv[++i];
+				if (ptouch_ctx_setfont(ctx, argv[++i]) != 0) {
+					exit(1);
+				}
 			} else {
 				usage(argv[0]);
 			}
 		} else if (strcmp(&argv[i][1], "-fontsize") == 0) {
 			if (i+1<argc) {
-				i++;
+				ptouch_ctx_setfontsize(ctx, strtol(argv[++i], NULL, 10));
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-copies") == 0) {
+			if (i+1<argc) {
+				opt->copies=strtol(argv[++i], NULL, 10);
+			} else {
+				usage(argv[0]);
+			}
+			if (opt->copies < 1) {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-template") == 0) {
+			if (i+1<argc) {
+				opt->template_file=argv[++i];
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-data") == 0) {
+			if (i+1<argc) {
+				opt->data_file=argv[++i];
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-count") == 0) {
+			if (i+1<argc) {
+				opt->count=strtol(argv[++i], NULL, 10);
+			} else {
+				usage(argv[0]);
+			}
+			if (opt->count < 1) {
+				printf(_("--count needs at least 1 label\n"));
+				exit(1);
+			}
+		} else if (strcmp(&argv[i][1], "-tape") == 0) {
+			if (i+1<argc) {
+				opt->tape_mm=strtol(argv[++i], NULL, 10);
 			} else {
 				usage(argv[0]);
 			}
 		} else if (strcmp(&argv[i][1], "-writepng") == 0) {
 			if (i+1<argc) {
-				save_png=argv[++i];
+				opt->save_png=argv[++i];
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-writeraw") == 0) {
+			if (i+1<argc) {
+				opt->save_raw=argv[++i];
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-metrics") == 0) {
+			if (i+1<argc) {
+				opt->metrics_file=argv[++i];
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-spool") == 0) {
+			if (i+1<argc) {
+				opt->spool_dir=argv[++i];
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-lp") == 0) {
+			if (i+1<argc) {
+				opt->lp_dev=argv[++i];
 			} else {
 				usage(argv[0]);
 			}
+		} else if (strcmp(&argv[i][1], "-length") == 0) {
+			if (i+1<argc) {
+				opt->length=strtol(argv[++i], NULL, 10);
+			} else {
+				usage(argv[0]);
+			}
+			if (opt->length < 1) {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-imagelength") == 0) {
+			if (i+1<argc) {
+				opt->image_length=strtol(argv[++i], NULL, 10);
+			} else {
+				usage(argv[0]);
+			}
+			if (opt->image_length < 1) {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-threshold") == 0) {
+			if (i+1<argc) {
+				opt->threshold=strtol(argv[++i], NULL, 10);
+			} else {
+				usage(argv[0]);
+			}
+			if ((opt->threshold < 1) || (opt->threshold > 100)) {
+				usage(argv[0]);
+			}
 		} else if (strcmp(&argv[i][1], "-cutmark") == 0) {
-			continue;	/* not done here */
+			add_cmd(opt, CMD_CUTMARK);
 		} else if (strcmp(&argv[i][1], "-info") == 0) {
-			continue;	/* not done here */
+			opt->info=1;
 		} else if (strcmp(&argv[i][1], "-image") == 0) {
 			if (i+1<argc) {
-				i++;
+				c=add_cmd(opt, CMD_IMAGE);
+				c->arg[0]=argv[++i];
+				c->lines=1;
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-svg") == 0) {
+			if (i+1<argc) {
+				c=add_cmd(opt, CMD_SVG);
+				c->arg[0]=argv[++i];
+				c->lines=1;
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-barcode") == 0) {
+			if ((i+2<argc) && (strcmp(argv[i+1], "code128") == 0)) {
+				c=add_cmd(opt, CMD_BARCODE);
+				c->arg[0]=argv[++i];
+				c->arg[1]=argv[++i];
+				c->lines=2;
+			} else {
+				usage(argv[0]);
+			}
+		} else if (strcmp(&argv[i][1], "-qr") == 0) {
+			if (i+1<argc) {
+				c=add_cmd(opt, CMD_QR);
+				c->arg[0]=argv[++i];
+				c->lines=1;
 			} else {
 				usage(argv[0]);
 			}
 		} else if (strcmp(&argv[i][1], "-text") == 0) {
+			c=add_cmd(opt, CMD_TEXT);
 			for (lines=0; (lines < MAX_LINES) && (i < argc); lines++) {
 				if ((i+1 >= argc) || (argv[i+1][0] == '-')) {
 					break;
 				}
 				i++;
+				c->arg[lines]=argv[i];
 			}
+			if (lines == 0) {
+				usage(argv[0]);
+			}
+			c->lines=lines;
 		} else if (strcmp(&argv[i][1], "-version") == 0) {
 			printf(_("ptouch-print version %s by Dominic Radermacher\n"), VERSION);
 			exit(0);
@@ -302,94 +1109,139 @@ int parse_args(int argc, char **argv)
 			usage(argv[0]);
 		}
 	}
+	/* a template label is never the same twice, use --count instead */
+	if ((opt->template_file != NULL) && (opt->copies > 1)) {
+		printf(_("--copies can not be used with --template, use --count\n"));
+		exit(1);
+	}
 	return i;
 }
 
+/* --------------------------------------------------------------------
+	Open the printer (or the raw file) and print. The device is left in
+	*ptdev for main() to close, also when this fails. Returns the exit
+	code of ptouch-print.
+   -------------------------------------------------------------------- */
+int run(ptouch_ctx ctx, struct _options *opt, pt_spool spool, ptouch_dev *ptdev, int tape_width)
+{
+	pt_label l=NULL;
+	int printing, r=0;
+
+	/* the printer is only needed to print or to ask for the tape */
+	if (opt->save_raw != NULL) {
+		if (ptouch_open_file(ctx, ptdev, opt->save_raw, opt->tape_mm) != 0) {
+			*ptdev=NULL;
+			return 1;
+		}
+	} else if ((opt->save_png == NULL) || (tape_width == 0)) {
+		if (opt->lp_dev != NULL) {
+			r=ptouch_open_lp(ctx, ptdev, opt->lp_dev, opt->tape_mm);
+		} else {
+			r=ptouch_open(ctx, ptdev);
+		}
+		if (r < 0) {
+			*ptdev=NULL;
+			return 5;
+		}
+		if (ptouch_init(*ptdev) != 0) {
+			printf(_("ptouch_init() failed\n"));
+		}
+		if (ptouch_getstatus(*ptdev) != 0) {
+			printf(_("ptouch_getstatus() failed\n"));
+			return 1;
+		}
+		if (tape_width == 0) {
+			tape_width=ptouch_getmaxwidth(*ptdev);
+		}
+	}
+	if (opt->info) {
+		printf(_("maximum printing width for this tape is %ipx\n"), tape_width);
+		return 0;
+	}
+	printing=(*ptdev != NULL) && ((opt->save_png == NULL) || (opt->save_raw != NULL));
+	if (printing && (opt->save_raw != NULL)) {
+		ptouch_init(*ptdev);	/* init was not sent yet */
+	}
+	if (opt->template_file != NULL) {
+		if (print_template(ctx, opt, printing?*ptdev:NULL, spool, tape_width) != 0) {
+			r=1;
+		}
+	} else if ((spool == NULL) || (opt->ncmds > 0)) {	/* else just resume */
+		if ((l=render_label(ctx, opt, tape_width)) == NULL) {
+			r=1;
+		} else if (opt->save_png != NULL) {
+			if (write_png(l, opt->save_png) != 0) {
+				r=1;
+			}
+		}
+		if (printing && (l != NULL) && (print_label(*ptdev, spool, l, opt->copies) != 0)) {
+			r=1;
+		}
+		pt_label_free(l);
+	}
+	if (printing && (spool != NULL) && (r == 0)) {
+		if (ptouch_rasterstart(*ptdev) != 0) {
+			printf(_("ptouch_rasterstart() failed\n"));
+			r=1;
+		} else if (pt_spool_run(spool, *ptdev) != 0) {
+			r=1;
+		}
+	}
+	if (printing && (r == 0)) {
+		if (ptouch_eject(*ptdev) != 0) {
+			printf(_("ptouch_eject() failed\n"));
+			r=-1;
+		} else if ((spool != NULL) && (pt_spool_done(spool) != 0)) {
+			r=1;
+		}
+	}
+	return r;
+}
+
 int main(int argc, char *argv[])
 {
-	int i, lines, tape_width;
-	char *line[MAX_LINES];
-	gdImage *im=NULL;
+	int i, tape_width=0, r=0;
+	struct _options opt;
+	pt_spool spool=NULL;
+	ptouch_ctx ctx;
 	ptouch_dev ptdev=NULL;
 
 	setlocale(LC_ALL, "");
 	bindtextdomain(PACKAGE, LOCALEDIR);
 	textdomain(PACKAGE);
-	i=parse_args(argc, argv);
-	if (i != argc) {
-		usage(argv[0]);
+	if ((ctx=ptouch_ctx_new()) == NULL) {
+		return 1;
 	}
-	if ((ptouch_open(&ptdev)) < 0) {
-		return 5;
+	memset(&opt, 0, sizeof(opt));
+	opt.copies=1;
+	opt.threshold=50;
+	i=parse_args(ctx, &opt, argc, argv);
+	if ((i != argc) || ((opt.template_file != NULL) && ((opt.ncmds > 0) || (opt.length > 0)))) {
+		usage(argv[0]);
 	}
-	if (ptouch_init(ptdev) != 0) {
-		printf(_("ptouch_init() failed\n"));
+	if (opt.tape_mm > 0) {
+		if ((tape_width=ptouch_tape_px(opt.tape_mm)) == 0) {
+			printf(_("unsupported tape width of %imm\n"), opt.tape_mm);
+			r=1;
+		}
+	} else if (opt.save_raw != NULL) {
+		printf(_("--writeraw needs --tape\n"));
+		r=1;
 	}
-	if (ptouch_getstatus(ptdev) != 0) {
-		printf(_("ptouch_getstatus() failed\n"));
-		return 1;
+	if ((r == 0) && (opt.spool_dir != NULL) && ((spool=pt_spool_open(opt.spool_dir)) == NULL)) {
+		r=1;
 	}
-	tape_width=ptouch_getmaxwidth(ptdev);
-	for (i=1; i<argc; i++) {
-		if (*argv[i] != '-') {
-			break;
-		}
-		if (strcmp(&argv[i][1], "-font") == 0) {
-			if (i+1<argc) {
-				font_file=argv[++i];
-			} else {
-				usage(argv[0]);
-			}
-		} else if (strcmp(&argv[i][1], "-fontsize") == 0) {
-			if (i+1<argc) {
-				fontsize=strtol(argv[++i], NULL, 10);
-			} else {
-				usage(argv[0]);
-			}
-		} else if (strcmp(&argv[i][1], "-writepng") == 0) {
-			if (i+1<argc) {
-				save_png=argv[++i];
-			} else {
-				usage(argv[0]);
-			}
-		} else if (strcmp(&argv[i][1], "-info") == 0) {
-			printf(_("maximum printing width for this tape is %ipx\n"), tape_width);
-			exit(0);
-		} else if (strcmp(&argv[i][1], "-image") == 0) {
-			im=image_load(argv[++i]);
-			if (im != NULL) {
-				print_img(ptdev, im);
-				gdImageDestroy(im);
-			}
-		} else if (strcmp(&argv[i][1], "-text") == 0) {
-			for (lines=0; (lines < MAX_LINES) && (i < argc); lines++) {
-				if ((i+1 >= argc) || (argv[i+1][0] == '-')) {
-					break;
-				}
-				i++;
-				line[lines]=argv[i];
-			}
-			if ((im=render_text(font_file, line, lines, tape_width)) == NULL) {
-				printf(_("could not render text\n"));
-				return 1;
-			}
-			if (save_png != NULL) {
-				write_png(im, save_png);
-			} else {
-				print_img(ptdev, im);
-			}
-			gdImageDestroy(im);
-		} else if (strcmp(&argv[i][1], "-cutmark") == 0) {
-			ptouch_cutmark(ptdev);
-		} else {
-			usage(argv[0]);
+	if (r == 0) {
+		r=run(ctx, &opt, spool, &ptdev, tape_width);
+		if ((opt.metrics_file != NULL) && (write_metrics(ptdev, r == 0, opt.metrics_file) != 0) && (r == 0)) {
+			r=1;
 		}
 	}
-	if (ptouch_eject(ptdev) != 0) {
-		printf(_("ptouch_eject() failed\n"));
-		return -1;
+	if (ptdev != NULL) {
+		ptouch_close(ptdev);
 	}
-	ptouch_close(ptdev);
-	libusb_exit(NULL);
-	return 0;
+	pt_spool_close(spool, r == 0);
+	ptouch_ctx_free(ctx);
+	free(opt.cmds);
+	return r;
 }
@@ -0,0 +1,1209 @@
+/*
+	ptouch-render - render labels directly into printer raster lines
+
+	Copyright (C) 2015 Dominic Radermacher <dominic.radermacher@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdio.h>
+#include <stdlib.h>	/* malloc(), free() */
+#include <string.h>	/* memset(), memcpy(), strchr() */
+#include <sys/types.h>	/* mkdir() */
+#include <sys/stat.h>	/* stat(), mkdir() */
+#include <unistd.h>	/* unlink(), close() */
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include <fontconfig/fontconfig.h>
+#include "config.h"
+#include "gettext.h"	/* gettext(), ngettext() */
+#include "ptouch.h"
+#include "ptouch-render.h"
+#include "ptouch-private.h"
+
+#define _(s) gettext(s)
+
+#define FONT_DPI	96	/* same resolution gdImageStringFT() uses */
+#define GLYPH_HASH	1024	/* buckets in the glyph cache */
+#define GLYPH_MAX	8192	/* flush the glyph cache above this */
+#define FONT_CACHE	"ptouch/fonts"	/* below $XDG_CACHE_HOME */
+#define FONT_CACHE_MAX	64	/* entries kept in the font cache */
+
+/* an opened font, kept until pt_font_cleanup() */
+struct _pt_font {
+	char *name;
+	FT_Face face;
+	int size;		/* size currently set on face */
+	struct _pt_render *r;	/* the caches the font belongs to */
+	struct _pt_font *next;
+};
+
+/* A rendered glyph. Each column is stored as a 128 bit mask (hi/lo)
+   with the topmost glyph row in bit 127, so drawing it is just a shift
+   and an OR per column into the label raster lines. */
+struct _pt_glyph {
+	struct _pt_font *font;	/* key: font, size, glyph index */
+	int size;
+	FT_UInt index;
+	int left;		/* bitmap_left */
+	int top;		/* bitmap_top */
+	int cols;
+	int rows;
+	FT_Pos advance;		/* in 1/64 px */
+	uint64_t *mask;		/* 2 words (hi, lo) per column */
+	struct _pt_glyph *next;
+};
+
+/* the font and glyph caches of a ptouch_ctx (ctx->render) */
+struct _pt_render {
+	FT_Library lib;
+	struct _pt_font *fonts;
+	struct _pt_glyph *glyphs[GLYPH_HASH];
+	int glyph_count;
+};
+
+/* --------------------------------------------------------------------
+	label bitmap
+   -------------------------------------------------------------------- */
+
+static void label_init(pt_label l, int height)
+{
+	l->width=0;
+	l->height=height;
+	l->offset=(PT_RASTER_PX/2)-(height/2);
+	ptouch_pack_init(&l->pack, height);
+}
+
+pt_label pt_label_new(int height, int width)
+{
+	pt_label l;
+
+	if ((height <= 0) || (height > PT_RASTER_PX)) {
+		return NULL;
+	}
+	if ((l=malloc(sizeof(struct _pt_label))) == NULL) {
+		return NULL;
+	}
+	label_init(l, height);
+	l->alloc=0;
+	l->raster=NULL;
+	l->ctx=NULL;
+	l->next=NULL;
+	if (pt_label_resize(l, width) != 0) {
+		free(l);
+		return NULL;
+	}
+	return l;
+}
+
+/* a blank label from the pool of ctx, see struct _ptouch_pool */
+pt_label pt_label_get(ptouch_ctx ctx, int height, int width)
+{
+	pt_label l;
+
+	if ((height <= 0) || (height > PT_RASTER_PX)) {
+		return NULL;
+	}
+	pthread_mutex_lock(&ctx->lock);
+	if ((l=ctx->pool.labels) != NULL) {
+		ctx->pool.labels=l->next;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	if (l == NULL) {
+		if ((l=pt_label_new(height, 0)) == NULL) {
+			return NULL;
+		}
+		l->ctx=ctx;
+		ptouch_pool_count(ctx);
+	}
+	label_init(l, height);
+	if (pt_label_resize(l, width) != 0) {
+		pt_label_free(l);
+		return NULL;
+	}
+	return l;
+}
+
+void pt_label_free(pt_label l)
+{
+	ptouch_ctx ctx;
+
+	if (l == NULL) {
+		return;
+	}
+	if ((ctx=l->ctx) != NULL) {
+		pthread_mutex_lock(&ctx->lock);
+		l->next=ctx->pool.labels;
+		ctx->pool.labels=l;
+		pthread_mutex_unlock(&ctx->lock);
+		return;
+	}
+	free(l->raster);
+	free(l);
+}
+
+/* change the label length, new columns are blank */
+int pt_label_resize(pt_label l, int width)
+{
+	uint8_t *p;
+	int n;
+
+	if (width > l->alloc) {
+		n=(l->alloc > 0)?l->alloc:64;
+		while (n < width) {
+			n*=2;
+		}
+		if ((p=realloc(l->raster, (size_t)n*PT_RASTER_BYTES)) == NULL) {
+			return -1;
+		}
+		if (l->ctx != NULL) {
+			ptouch_pool_count(l->ctx);
+		}
+		l->raster=p;
+		l->alloc=n;
+	}
+	if (width > l->width) {
+		memset(pt_label_column(l, l->width), 0, (size_t)(width-l->width)*PT_RASTER_BYTES);
+	}
+	l->width=width;
+	return 0;
+}
+
+void pt_label_setpixel(pt_label l, int x, int y)
+{
+	int px;
+
+	if ((x < 0) || (x >= l->width) || (y < 0) || (y >= l->height)) {
+		return;
+	}
+	px=l->offset+l->height-1-y;
+	pt_label_column(l, x)[15-(px/8)] |= 1<<(px%8);
+}
+
+int pt_label_getpixel(pt_label l, int x, int y)
+{
+	int px;
+
+	if ((x < 0) || (x >= l->width) || (y < 0) || (y >= l->height)) {
+		return 0;
+	}
+	px=l->offset+l->height-1-y;
+	return (pt_label_column(l, x)[15-(px/8)] >> (px%8)) & 1;
+}
+
+/* add the columns of src at the end of the label */
+int pt_label_append(pt_label l, pt_label src)
+{
+	int x=l->width;
+
+	if (src->height != l->height) {
+		return -1;
+	}
+	if (src->width == 0) {
+		return 0;
+	}
+	if (pt_label_resize(l, x+src->width) != 0) {
+		return -1;
+	}
+	memcpy(pt_label_column(l, x), src->raster, (size_t)src->width*PT_RASTER_BYTES);
+	return 0;
+}
+
+/* OR the columns of src into the label, starting at column 0 */
+int pt_label_merge(pt_label l, pt_label src)
+{
+	uint8_t *d, *s;
+
+	if (src->height != l->height) {
+		return -1;
+	}
+	if ((src->width > l->width) && (pt_label_resize(l, src->width) != 0)) {
+		return -1;
+	}
+	d=l->raster;
+	s=src->raster;
+	for (int i=0; i<src->width*PT_RASTER_BYTES; i++) {
+		d[i] |= s[i];
+	}
+	return 0;
+}
+
+/* a "cut here" mark, the same dashed line ptouch_cutmark() prints */
+#define CUTMARK_SPACING 5
+int pt_label_cutmark(pt_label l)
+{
+	int x=l->width+CUTMARK_SPACING;
+
+	if (pt_label_resize(l, x+1+CUTMARK_SPACING) != 0) {
+		return -1;
+	}
+	memcpy(pt_label_column(l, x), l->pack.cutmark, PT_RASTER_BYTES);
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	128 bit column helpers - a raster line is a big endian 128 bit
+	number where print head pixel n is bit n
+   -------------------------------------------------------------------- */
+
+static uint64_t load_be64(const uint8_t *p)
+{
+	uint64_t v=0;
+
+	for (int i=0; i<8; i++) {
+		v=(v<<8) | p[i];
+	}
+	return v;
+}
+
+static void store_be64(uint8_t *p, uint64_t v)
+{
+	for (int i=7; i>=0; i--) {
+		p[i]=v & 0xff;
+		v>>=8;
+	}
+}
+
+/* shift a 128 bit value, positive s shifts right */
+static void shift128(uint64_t *hi, uint64_t *lo, int s)
+{
+	if ((s >= 128) || (s <= -128)) {
+		*hi=*lo=0;
+	} else if (s >= 64) {
+		*lo=*hi >> (s-64);
+		*hi=0;
+	} else if (s > 0) {
+		*lo=(*lo >> s) | (*hi << (64-s));
+		*hi>>=s;
+	} else if (s <= -64) {
+		*hi=*lo << (-s-64);
+		*lo=0;
+	} else if (s < 0) {
+		*hi=(*hi << -s) | (*lo >> (64+s));
+		*lo<<=-s;
+	}
+}
+
+/* mask of all print head pixels belonging to the label */
+static void label_mask(pt_label l, uint64_t *hi, uint64_t *lo)
+{
+	*hi=~(uint64_t)0;
+	*lo=~(uint64_t)0;
+	shift128(hi, lo, PT_RASTER_PX-l->height);	/* keep height bits */
+	shift128(hi, lo, -l->offset);
+}
+
+/* --------------------------------------------------------------------
+	fonts and glyph cache
+   -------------------------------------------------------------------- */
+
+/* name of the font cache file, the directory is created if needed */
+static char *font_cache_file(int create)
+{
+	const char *dir=getenv("XDG_CACHE_HOME");
+	const char *sub="";
+	char *file;
+	size_t len;
+
+	if ((dir == NULL) || (*dir == '\0')) {
+		if ((dir=getenv("HOME")) == NULL) {
+			return NULL;
+		}
+		sub="/.cache";
+	}
+	len=strlen(dir)+strlen(sub)+strlen(FONT_CACHE)+2;
+	if ((file=malloc(len)) == NULL) {
+		return NULL;
+	}
+	if (create) {
+		snprintf(file, len, "%s%s", dir, sub);
+		mkdir(file, 0755);
+		snprintf(file, len, "%s%s/ptouch", dir, sub);
+		mkdir(file, 0755);
+	}
+	snprintf(file, len, "%s%s/%s", dir, sub, FONT_CACHE);
+	return file;
+}
+
+/* --------------------------------------------------------------------
+	The font cache has one line per resolved font name:
+	<name> TAB <face index> TAB <mtime> TAB <file>
+	An entry is valid as long as the font file has the same mtime.
+	Before the entries come lines with an empty name, one for each
+	config file, font directory and cache directory of fontconfig:
+	TAB <mtime> TAB <file>
+	with an mtime of -1 if the file did not exist. When one of them
+	changed, fonts were installed, removed or configured and the whole
+	cache is dropped. At most FONT_CACHE_MAX entries are kept.
+   -------------------------------------------------------------------- */
+
+/* split a cache line, returns 0 if it is valid */
+static int font_cache_parse(char *line, char **name, long *index, long *mtime, char **file)
+{
+	char *p, *q;
+
+	if ((p=strchr(line, '\t')) == NULL) {
+		return -1;
+	}
+	*p++='\0';
+	*name=line;
+	*index=0;
+	if (**name != '\0') {		/* not a fontconfig state line */
+		*index=strtol(p, &q, 10);
+		if (*q != '\t') {
+			return -1;
+		}
+		p=q+1;
+	}
+	*mtime=strtol(p, &q, 10);
+	if (*q != '\t') {
+		return -1;
+	}
+	*file=q+1;
+	(*file)[strcspn(*file, "\n")]='\0';
+	return 0;
+}
+
+/* does file still have this mtime (-1: does it still not exist)? */
+static int font_cache_same(const char *file, long mtime)
+{
+	struct stat st;
+
+	if (stat(file, &st) != 0) {
+		return mtime == -1;
+	}
+	return (long)st.st_mtime == mtime;
+}
+
+/* 1 if the fontconfig state recorded in the cache is unchanged */
+static int font_cache_fresh(FILE *f)
+{
+	char line[4096], *name, *file;
+	long index, mtime;
+	int n=0;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if ((font_cache_parse(line, &name, &index, &mtime, &file) != 0) || (*name != '\0')) {
+			continue;
+		}
+		if (!font_cache_same(file, mtime)) {
+			return 0;
+		}
+		n++;
+	}
+	rewind(f);
+	return n > 0;
+}
+
+static char *font_cache_get(const char *name, int *index)
+{
+	char line[4096], *cache, *n, *file, *path=NULL;
+	long idx, mtime;
+	FILE *f;
+
+	if ((cache=font_cache_file(0)) == NULL) {
+		return NULL;
+	}
+	f=fopen(cache, "r");
+	free(cache);
+	if (f == NULL) {
+		return NULL;
+	}
+	if (!font_cache_fresh(f)) {
+		fclose(f);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if ((font_cache_parse(line, &n, &idx, &mtime, &file) != 0) || (strcmp(n, name) != 0)) {
+			continue;
+		}
+		if (!font_cache_same(file, mtime)) {
+			continue;
+		}
+		free(path);
+		path=strdup(file);
+		*index=idx;
+	}
+	fclose(f);
+	return path;
+}
+
+/* write a state line for each file in l */
+static void font_cache_state(FILE *f, FcStrList *l)
+{
+	FcChar8 *s;
+	struct stat st;
+
+	if (l == NULL) {
+		return;
+	}
+	while ((s=FcStrListNext(l)) != NULL) {
+		if (strchr((const char *)s, '\n') == NULL) {
+			fprintf(f, "\t%li\t%s\n", (stat((const char *)s, &st) == 0)?(long)st.st_mtime:-1L, s);
+		}
+	}
+	FcStrListDone(l);
+}
+
+/* rewrite the cache with the entry for name added, fontconfig has to
+   be initialized. The file is replaced with rename(), so concurrent
+   readers see either the old or the new one */
+static void font_cache_put(const char *name, const char *path, int index)
+{
+	char line[4096], *keep[FONT_CACHE_MAX], *cache, *tmp, *n, *file;
+	long idx, mtime;
+	struct stat st;
+	int i, fd, k=0;
+	FILE *f;
+
+	if ((strchr(name, '\t') != NULL) || (strchr(name, '\n') != NULL) || (*name == '\0')) {
+		return;
+	}
+	if (stat(path, &st) != 0) {
+		return;
+	}
+	if ((cache=font_cache_file(1)) == NULL) {
+		return;
+	}
+	/* the entries still valid, the oldest ones go above FONT_CACHE_MAX */
+	if ((f=fopen(cache, "r")) != NULL) {
+		if (font_cache_fresh(f)) {
+			while (fgets(line, sizeof(line), f) != NULL) {
+				if ((tmp=strdup(line)) == NULL) {
+					break;
+				}
+				if ((font_cache_parse(line, &n, &idx, &mtime, &file) != 0) || (*n == '\0') ||
+				    (strcmp(n, name) == 0) || !font_cache_same(file, mtime)) {
+					free(tmp);
+					continue;
+				}
+				if (k == FONT_CACHE_MAX-1) {
+					free(keep[0]);
+					memmove(keep, keep+1, (k-1)*sizeof(keep[0]));
+					k--;
+				}
+				keep[k++]=tmp;
+			}
+		}
+		fclose(f);
+	}
+	if ((tmp=malloc(strlen(cache)+8)) != NULL) {
+		sprintf(tmp, "%s.XXXXXX", cache);
+		if ((fd=mkstemp(tmp)) >= 0) {
+			if ((f=fdopen(fd, "w")) != NULL) {
+				font_cache_state(f, FcConfigGetConfigFiles(NULL));
+				font_cache_state(f, FcConfigGetFontDirs(NULL));
+				font_cache_state(f, FcConfigGetCacheDirs(NULL));
+				for (i=0; i<k; i++) {
+					fputs(keep[i], f);
+				}
+				fprintf(f, "%s\t%i\t%li\t%s\n", name, index, (long)st.st_mtime, path);
+				if (fclose(f) != 0) {
+					unlink(tmp);
+				} else if (rename(tmp, cache) != 0) {
+					unlink(tmp);
+				}
+			} else {
+				close(fd);
+				unlink(tmp);
+			}
+		}
+		free(tmp);
+	}
+	for (i=0; i<k; i++) {
+		free(keep[i]);
+	}
+	free(cache);
+}
+
+/* resolve a font name like gd does: either a file name or a
+   fontconfig pattern like "DejaVuSans" or "Ubuntu:medium".
+   fontconfig is only initialized if the font cache can't help */
+static char *font_lookup(const char *name, int *index)
+{
+	FcPattern *pat, *match;
+	FcResult res;
+	FcChar8 *file;
+	char *path=NULL;
+
+	*index=0;
+	if (strchr(name, '/') != NULL) {
+		return strdup(name);
+	}
+	if ((path=font_cache_get(name, index)) != NULL) {
+		return path;
+	}
+	if (FcInit() != FcTrue) {
+		fprintf(stderr, _("warning: font config not available\n"));
+		return NULL;
+	}
+	FcInitBringUptoDate();	/* fonts installed since, in long running programs */
+	if ((pat=FcNameParse((const FcChar8 *)name)) == NULL) {
+		return NULL;
+	}
+	FcConfigSubstitute(NULL, pat, FcMatchPattern);
+	FcDefaultSubstitute(pat);
+	if ((match=FcFontMatch(NULL, pat, &res)) != NULL) {
+		if (FcPatternGetString(match, FC_FILE, 0, &file) == FcResultMatch) {
+			path=strdup((const char *)file);
+			FcPatternGetInteger(match, FC_INDEX, 0, index);
+		}
+		FcPatternDestroy(match);
+	}
+	FcPatternDestroy(pat);
+	if (path != NULL) {
+		font_cache_put(name, path, *index);
+	}
+	return path;
+}
+
+static void render_free(void *data);
+
+/* the caches of ctx, created on first use */
+static struct _pt_render *render_get(ptouch_ctx ctx)
+{
+	struct _pt_render *r;
+
+	if (ctx->render != NULL) {
+		return ctx->render;
+	}
+	if ((r=malloc(sizeof(struct _pt_render))) == NULL) {
+		return NULL;
+	}
+	memset(r, 0, sizeof(struct _pt_render));
+	if (FT_Init_FreeType(&r->lib) != 0) {
+		fprintf(stderr, _("FT_Init_FreeType() failed\n"));
+		free(r);
+		return NULL;
+	}
+	ctx->render=r;
+	ctx->render_free=render_free;
+	return r;
+}
+
+static struct _pt_font *font_open(ptouch_ctx ctx, const char *name)
+{
+	struct _pt_render *r;
+	struct _pt_font *f;
+	char *path;
+	int index;
+
+	if ((r=render_get(ctx)) == NULL) {
+		return NULL;
+	}
+	for (f=r->fonts; f != NULL; f=f->next) {
+		if (strcmp(f->name, name) == 0) {
+			return f;
+		}
+	}
+	if ((path=font_lookup(name, &index)) == NULL) {
+		fprintf(stderr, _("could not find font '%s'\n"), name);
+		return NULL;
+	}
+	if ((f=malloc(sizeof(struct _pt_font))) == NULL) {
+		free(path);
+		return NULL;
+	}
+	if (FT_New_Face(r->lib, path, index, &f->face) != 0) {
+		fprintf(stderr, _("could not open font file '%s'\n"), path);
+		free(path);
+		free(f);
+		return NULL;
+	}
+	free(path);
+	f->name=strdup(name);
+	f->size=0;
+	f->r=r;
+	f->next=r->fonts;
+	r->fonts=f;
+	return f;
+}
+
+static void glyph_flush(struct _pt_render *r)
+{
+	struct _pt_glyph *g;
+
+	for (int i=0; i<GLYPH_HASH; i++) {
+		while ((g=r->glyphs[i]) != NULL) {
+			r->glyphs[i]=g->next;
+			free(g->mask);
+			free(g);
+		}
+	}
+	r->glyph_count=0;
+}
+
+static unsigned int glyph_hash(struct _pt_font *f, int size, FT_UInt index)
+{
+	uintptr_t h=(uintptr_t)f;
+
+	h=(h >> 4) ^ ((uintptr_t)size * 2654435761u) ^ ((uintptr_t)index * 40503u);
+	return h % GLYPH_HASH;
+}
+
+/* set the size on the face, kerning and glyph rendering depend on it */
+static int font_setsize(struct _pt_font *f, int size)
+{
+	if (f->size != size) {
+		if (FT_Set_Char_Size(f->face, 0, size*64, FONT_DPI, FONT_DPI) != 0) {
+			return -1;
+		}
+		f->size=size;
+	}
+	return 0;
+}
+
+/* fetch a glyph from the cache, rendering it with FreeType on a miss */
+static struct _pt_glyph *glyph_get(struct _pt_font *f, int size, FT_UInt index)
+{
+	struct _pt_glyph *g;
+	FT_Bitmap *bm;
+	unsigned int h=glyph_hash(f, size, index);
+	int c, r;
+
+	for (g=f->r->glyphs[h]; g != NULL; g=g->next) {
+		if ((g->font == f) && (g->size == size) && (g->index == index)) {
+			return g;
+		}
+	}
+	if (font_setsize(f, size) != 0) {
+		return NULL;
+	}
+	if (FT_Load_Glyph(f->face, index, FT_LOAD_RENDER | FT_LOAD_TARGET_MONO) != 0) {
+		return NULL;
+	}
+	bm=&f->face->glyph->bitmap;
+	if (f->r->glyph_count >= GLYPH_MAX) {
+		glyph_flush(f->r);
+	}
+	if ((g=malloc(sizeof(struct _pt_glyph))) == NULL) {
+		return NULL;
+	}
+	g->font=f;
+	g->size=size;
+	g->index=index;
+	g->left=f->face->glyph->bitmap_left;
+	g->top=f->face->glyph->bitmap_top;
+	g->cols=bm->width;
+	g->rows=bm->rows;
+	g->advance=f->face->glyph->advance.x;
+	if ((g->mask=calloc((g->cols > 0)?g->cols*2:1, sizeof(uint64_t))) == NULL) {
+		free(g);
+		return NULL;
+	}
+	/* transpose the row oriented FreeType bitmap into column masks,
+	   rows that do not fit on a print head are dropped */
+	for (r=0; (r < g->rows) && (r < PT_RASTER_PX); r++) {
+		uint8_t *row=bm->buffer+r*abs(bm->pitch);
+		int bit=127-r;
+		for (c=0; c<g->cols; c++) {
+			if (bm->pixel_mode == FT_PIXEL_MODE_MONO) {
+				if ((row[c/8] & (0x80 >> (c%8))) == 0) {
+					continue;
+				}
+			} else if (row[c] < 128) {	/* grayscale fallback */
+				continue;
+			}
+			g->mask[c*2+((bit >= 64)?0:1)] |= (uint64_t)1 << (bit%64);
+		}
+	}
+	g->next=f->r->glyphs[h];
+	f->r->glyphs[h]=g;
+	f->r->glyph_count++;
+	return g;
+}
+
+/* decode one UTF-8 character, invalid bytes are taken as latin1 */
+static const char *utf8_next(const char *s, unsigned long *cp)
+{
+	const unsigned char *p=(const unsigned char *)s;
+	int n, i;
+
+	if (p[0] < 0x80) {
+		*cp=p[0];
+		return s+1;
+	} else if ((p[0] & 0xe0) == 0xc0) {
+		*cp=p[0] & 0x1f;
+		n=1;
+	} else if ((p[0] & 0xf0) == 0xe0) {
+		*cp=p[0] & 0x0f;
+		n=2;
+	} else if ((p[0] & 0xf8) == 0xf0) {
+		*cp=p[0] & 0x07;
+		n=3;
+	} else {
+		*cp=p[0];
+		return s+1;
+	}
+	for (i=1; i<=n; i++) {
+		if ((p[i] & 0xc0) != 0x80) {
+			*cp=p[0];
+			return s+1;
+		}
+		*cp=(*cp << 6) | (p[i] & 0x3f);
+	}
+	return s+n+1;
+}
+
+/* walk through the glyphs of a text, calling fn() for each of them
+   with its pen position in px. Returns the number of glyphs or -1 */
+static int text_layout(struct _pt_font *f, int size, const char *text,
+	void (*fn)(struct _pt_glyph *g, int x, void *data), void *data)
+{
+	struct _pt_glyph *g;
+	FT_UInt index, prev=0;
+	FT_Vector kern;
+	FT_Pos pen=0;
+	unsigned long cp;
+	int n=0;
+
+	if (font_setsize(f, size) != 0) {
+		return -1;
+	}
+	while (*text != '\0') {
+		text=utf8_next(text, &cp);
+		index=FT_Get_Char_Index(f->face, cp);
+		if ((prev != 0) && FT_HAS_KERNING(f->face)) {
+			if (FT_Get_Kerning(f->face, prev, index, FT_KERNING_DEFAULT, &kern) == 0) {
+				pen+=kern.x;
+			}
+		}
+		if ((g=glyph_get(f, size, index)) == NULL) {
+			return -1;
+		}
+		fn(g, (pen+32) >> 6, data);
+		pen+=g->advance;
+		prev=index;
+		n++;
+	}
+	return n;
+}
+
+struct extent {
+	int xmin, xmax, ascent, descent, first;
+};
+
+static void extent_glyph(struct _pt_glyph *g, int x, void *data)
+{
+	struct extent *e=data;
+
+	if (g->cols == 0) {
+		return;
+	}
+	if (e->first || (x+g->left < e->xmin)) {
+		e->xmin=x+g->left;
+	}
+	if (e->first || (x+g->left+g->cols > e->xmax)) {
+		e->xmax=x+g->left+g->cols;
+	}
+	if (e->first || (g->top > e->ascent)) {
+		e->ascent=g->top;
+	}
+	if (e->first || (g->rows-g->top > e->descent)) {
+		e->descent=g->rows-g->top;
+	}
+	e->first=0;
+}
+
+static int text_measure(struct _pt_font *f, int size, const char *text, struct extent *e)
+{
+	memset(e, 0, sizeof(struct extent));
+	e->first=1;
+	if (text_layout(f, size, text, extent_glyph, e) < 0) {
+		return -1;
+	}
+	if (e->xmin > 0) {	/* drawing starts at the pen origin */
+		e->xmin=0;
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Built-in bitmap fonts need neither FreeType nor fontconfig, every
+	font column is scaled and ORed into the label raster directly.
+   -------------------------------------------------------------------- */
+#define is_bitfont(font)	(strncmp(font, PT_BITFONT_PREFIX, strlen(PT_BITFONT_PREFIX)) == 0)
+
+static const struct _pt_bitfont *bitfont_get(const char *font)
+{
+	const struct _pt_bitfont *f;
+
+	if ((f=pt_bitfont_find(font+strlen(PT_BITFONT_PREFIX))) == NULL) {
+		fprintf(stderr, _("unknown builtin font '%s'\n"), font);
+	}
+	return f;
+}
+
+static int bitfont_extent(const char *font, int size, const char *text, int *width, int *ascent, int *descent)
+{
+	const struct _pt_bitfont *f;
+	unsigned long cp;
+	int n=0;
+
+	if (((f=bitfont_get(font)) == NULL) || (size < 1)) {
+		return -1;
+	}
+	while (*text != '\0') {
+		text=utf8_next(text, &cp);
+		n++;
+	}
+	if (width != NULL) {	/* one empty column between characters */
+		*width=(n > 0)?(n*(f->width+f->bold+1)-1)*size:0;
+	}
+	if (ascent != NULL) {
+		*ascent=f->height*size;
+	}
+	if (descent != NULL) {
+		*descent=0;
+	}
+	return 0;
+}
+
+static int bitfont_draw(pt_label l, const char *font, int size, int x, int baseline, const char *text)
+{
+	const struct _pt_bitfont *f;
+	uint64_t hi, lo, clip_hi, clip_lo;
+	unsigned long cp;
+	uint16_t bits;
+	uint8_t *col;
+	int c, k, r, s;
+
+	if (((f=bitfont_get(font)) == NULL) || (size < 1) || (f->height*size > PT_RASTER_PX)) {
+		return -1;
+	}
+	/* the top font row goes to bit 127, like the glyph masks */
+	s=PT_RASTER_PX-(l->offset+l->height-baseline+f->height*size);
+	label_mask(l, &clip_hi, &clip_lo);
+	while (*text != '\0') {
+		text=utf8_next(text, &cp);
+		for (c=0; c<f->width+f->bold; c++, x+=size) {
+			if ((bits=pt_bitfont_column(f, cp, c)) == 0) {
+				continue;
+			}
+			hi=0;
+			lo=0;
+			for (r=0; r<f->height; r++) {
+				if ((bits & (1 << r)) == 0) {
+					continue;
+				}
+				for (k=r*size; k<(r+1)*size; k++) {
+					if (k < 64) {
+						hi|=(uint64_t)1 << (63-k);
+					} else {
+						lo|=(uint64_t)1 << (127-k);
+					}
+				}
+			}
+			shift128(&hi, &lo, s);
+			hi&=clip_hi;
+			lo&=clip_lo;
+			for (k=x; k<x+size; k++) {
+				if ((k < 0) || (k >= l->width)) {
+					continue;
+				}
+				col=pt_label_column(l, k);
+				store_be64(col, load_be64(col) | hi);
+				store_be64(col+8, load_be64(col+8) | lo);
+			}
+		}
+		x+=size;
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Measure the ink of a text. width is the number of columns
+	pt_text_draw() will use, ascent/descent are the number of px
+	above and below the baseline.
+   -------------------------------------------------------------------- */
+int pt_text_extent(ptouch_ctx ctx, const char *font, int size, const char *text, int *width, int *ascent, int *descent)
+{
+	struct _pt_font *f;
+	struct extent e;
+
+	if (is_bitfont(font)) {
+		return bitfont_extent(font, size, text, width, ascent, descent);
+	}
+	if ((f=font_open(ctx, font)) == NULL) {
+		return -1;
+	}
+	if (text_measure(f, size, text, &e) != 0) {
+		return -1;
+	}
+	if (width != NULL) {
+		*width=e.xmax-e.xmin;
+	}
+	if (ascent != NULL) {
+		*ascent=e.ascent;
+	}
+	if (descent != NULL) {
+		*descent=e.descent;
+	}
+	return 0;
+}
+
+struct draw {
+	pt_label l;
+	int x;			/* pen origin in label columns */
+	int top;		/* print head pixel of the baseline */
+	uint64_t clip_hi, clip_lo;
+};
+
+static void draw_glyph(struct _pt_glyph *g, int x, void *data)
+{
+	struct draw *d=data;
+	uint64_t hi, lo;
+	uint8_t *col;
+	int c, cx, s;
+
+	/* topmost glyph row goes to print head pixel top+g->top-1,
+	   but is stored in bit 127 */
+	s=PT_RASTER_PX-(d->top+g->top);
+	for (c=0; c<g->cols; c++) {
+		cx=d->x+x+g->left+c;
+		if ((cx < 0) || (cx >= d->l->width)) {
+			continue;
+		}
+		hi=g->mask[c*2];
+		lo=g->mask[c*2+1];
+		if ((hi | lo) == 0) {
+			continue;
+		}
+		shift128(&hi, &lo, s);
+		col=pt_label_column(d->l, cx);
+		store_be64(col, load_be64(col) | (hi & d->clip_hi));
+		store_be64(col+8, load_be64(col+8) | (lo & d->clip_lo));
+	}
+}
+
+/* --------------------------------------------------------------------
+	Draw a text into a label. x is the first column to use, baseline
+	the label row of the font baseline. Nothing outside the label is
+	touched.
+   -------------------------------------------------------------------- */
+int pt_text_draw(ptouch_ctx ctx, pt_label l, const char *font, int size, int x, int baseline, const char *text)
+{
+	struct _pt_font *f;
+	struct extent e;
+	struct draw d;
+
+	if (is_bitfont(font)) {
+		return bitfont_draw(l, font, size, x, baseline, text);
+	}
+	if ((f=font_open(ctx, font)) == NULL) {
+		return -1;
+	}
+	if (text_measure(f, size, text, &e) != 0) {
+		return -1;
+	}
+	d.l=l;
+	d.x=x-e.xmin;
+	d.top=l->offset+l->height-baseline;
+	label_mask(l, &d.clip_hi, &d.clip_lo);
+	if (text_layout(f, size, text, draw_glyph, &d) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Font size solver. The biggest font size where every line fits is
+	found by doubling the size until it does not fit any more and then
+	a binary search, so it takes about 2*log2(size) measurements of
+	the text instead of one per size. Every size is measured only once,
+	rendering with the chosen size reuses its measurement.
+   -------------------------------------------------------------------- */
+#define FIT_PROBES	32	/* cached measurements per fit */
+#define FIT_MAX_SIZE	4096
+
+struct fit {
+	ptouch_ctx ctx;
+	const char *font;
+	char **line;
+	int lines;
+	int probes;
+	struct {
+		int size;
+		int width;	/* of the widest line */
+		int height;	/* of the highest line */
+	} probe[FIT_PROBES];
+};
+
+static int fit_measure(struct fit *f, int size, int *width, int *height)
+{
+	int i, w, ascent, descent;
+
+	for (i=0; i<f->probes; i++) {
+		if (f->probe[i].size == size) {
+			*width=f->probe[i].width;
+			*height=f->probe[i].height;
+			return 0;
+		}
+	}
+	*width=0;
+	*height=0;
+	for (i=0; i<f->lines; i++) {
+		if (pt_text_extent(f->ctx, f->font, size, f->line[i], &w, &ascent, &descent) != 0) {
+			return -1;
+		}
+		if (w > *width) {
+			*width=w;
+		}
+		if (ascent+descent > *height) {
+			*height=ascent+descent;
+		}
+	}
+	if (f->probes < FIT_PROBES) {
+		f->probe[f->probes].size=size;
+		f->probe[f->probes].width=*width;
+		f->probe[f->probes].height=*height;
+		f->probes++;
+	}
+	return 0;
+}
+
+static int fit_ok(struct fit *f, int size, int want_px, int max_width)
+{
+	int width, height;
+
+	if (fit_measure(f, size, &width, &height) != 0) {
+		return 0;
+	}
+	return (height <= want_px) && ((max_width <= 0) || (width <= max_width));
+}
+
+/* the biggest size where every line is at most want_px high and, if
+   max_width > 0, at most max_width columns wide, or -1 */
+static int fit_solve(struct fit *f, int want_px, int max_width)
+{
+	int lo=is_bitfont(f->font)?1:4, hi, mid;
+
+	if (!fit_ok(f, lo, want_px, max_width)) {
+		return -1;
+	}
+	for (hi=lo*2; (hi <= FIT_MAX_SIZE) && fit_ok(f, hi, want_px, max_width); hi*=2) {
+		lo=hi;
+	}
+	while (hi-lo > 1) {	/* lo fits, hi does not */
+		mid=(lo+hi)/2;
+		if (fit_ok(f, mid, want_px, max_width)) {
+			lo=mid;
+		} else {
+			hi=mid;
+		}
+	}
+	return lo;
+}
+
+/* --------------------------------------------------------------------
+	Find out which fontsize we need for a given font to get a
+	specified pixel size
+   -------------------------------------------------------------------- */
+int pt_text_fit(ptouch_ctx ctx, const char *font, const char *text, int want_px)
+{
+	struct fit f={ctx, font, (char **)&text, 1, 0};
+
+	return fit_solve(&f, want_px, 0);
+}
+
+/* --------------------------------------------------------------------
+	Render 1-4 lines of text for a tape. If *size is 0, the biggest
+	font size where every line fits is chosen and stored in *size.
+   -------------------------------------------------------------------- */
+pt_label pt_render_text(ptouch_ctx ctx, const char *font, int *size, char *line[], int lines, int tape_width)
+{
+	return pt_render_text_len(ctx, font, size, line, lines, tape_width, 0);
+}
+
+/* the same, but if max_width > 0 the chosen size also keeps every line
+   within max_width columns */
+pt_label pt_render_text_len(ptouch_ctx ctx, const char *font, int *size, char *line[], int lines, int tape_width, int max_width)
+{
+	struct fit f={ctx, font, line, lines, 0};
+	int i, x, fsz=*size, ascent;
+	pt_label l=NULL;
+
+	if (fsz <= 0) {
+		if ((fsz=fit_solve(&f, tape_width/lines, max_width)) < 0) {
+			fprintf(stderr, _("could not estimate needed font size\n"));
+			return NULL;
+		}
+		*size=fsz;
+	}
+	if (fit_measure(&f, fsz, &x, &i) != 0) {
+		return NULL;
+	}
+	if ((l=pt_label_get(ctx, tape_width, x)) == NULL) {
+		return NULL;
+	}
+	/* the topmost pixel of each line goes to the top of its slot */
+	for (i=0; i<lines; i++) {
+		if ((pt_text_extent(ctx, font, fsz, line[i], NULL, &ascent, NULL) != 0) ||
+		    (pt_text_draw(ctx, l, font, fsz, 0, i*(tape_width/lines)+ascent, line[i]) != 0)) {
+			fprintf(stderr, _("could not render line %i\n"), i+1);
+			pt_label_free(l);
+			return NULL;
+		}
+	}
+	return l;
+}
+
+/* --------------------------------------------------------------------
+	Render line number n of a text with the given number of lines.
+	The label has the full tape height, the line is at its place, so
+	the lines can be combined with pt_label_merge().
+   -------------------------------------------------------------------- */
+pt_label pt_render_line(ptouch_ctx ctx, const char *font, int size, const char *text, int tape_width, int n, int lines)
+{
+	int width, ascent;
+	pt_label l;
+
+	if (pt_text_extent(ctx, font, size, text, &width, &ascent, NULL) != 0) {
+		return NULL;
+	}
+	if ((l=pt_label_get(ctx, tape_width, width)) == NULL) {
+		return NULL;
+	}
+	if (pt_text_draw(ctx, l, font, size, 0, n*(tape_width/lines)+ascent, text) != 0) {
+		pt_label_free(l);
+		return NULL;
+	}
+	return l;
+}
+
+static void render_free(void *data)
+{
+	struct _pt_render *r=data;
+	struct _pt_font *f;
+
+	glyph_flush(r);
+	while ((f=r->fonts) != NULL) {
+		r->fonts=f->next;
+		FT_Done_Face(f->face);
+		free(f->name);
+		free(f);
+	}
+	FT_Done_FreeType(r->lib);
+	free(r);
+}
+
+/* drop all fonts and glyphs of ctx, ptouch_ctx_free() does it too */
+void pt_font_cleanup(ptouch_ctx ctx)
+{
+	if (ctx->render != NULL) {
+		render_free(ctx->render);
+		ctx->render=NULL;
+		ctx->render_free=NULL;
+	}
+}
@@ -0,0 +1,385 @@
+/*
+	ptouch-spool - crash safe on disk queue of print jobs
+
+	Copyright (C) 2015 Dominic Radermacher <dominic.radermacher@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* --------------------------------------------------------------------
+	Jobs are appended to <dir>/spool in a write buffer and the file is
+	only synced every SPOOL_SYNC_JOBS jobs and before printing starts,
+	so queueing a job costs about a memcpy. While printing, a job is
+	marked SPOOL_SENDING before it is sent, and these marks are synced
+	at most every SPOOL_SYNC_MS. A label is only finished when the tape
+	was fed and cut, so the jobs are marked SPOOL_DONE by pt_spool_done()
+	once the tape was ejected. After a crash the next run starts at the
+	first job that is not known to be done, so labels may be printed
+	twice but never get lost. When every job is done the spool is
+	truncated.
+   -------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>	/* malloc(), free() */
+#include <string.h>	/* memcpy(), memcmp() */
+#include <errno.h>
+#include <time.h>	/* clock_gettime() */
+#include <fcntl.h>	/* open() */
+#include <unistd.h>	/* pread(), pwrite(), fdatasync() */
+#include <sys/file.h>	/* flock() */
+#include <sys/stat.h>	/* mkdir() */
+#include "config.h"
+#include "gettext.h"	/* gettext(), ngettext() */
+#include "ptouch.h"
+#include "ptouch-spool.h"
+
+#define _(s) gettext(s)
+
+#define SPOOL_SYNC_JOBS	1024		/* fsync at least this often */
+#define SPOOL_WRITE_BUF	(256*1024)	/* write() at least this often */
+#define SPOOL_SYNC_MS	200		/* fsync job states this often */
+
+static uint32_t fnv1a(const uint8_t *data, size_t len)
+{
+	uint32_t h=2166136261u;
+
+	for (size_t i=0; i<len; i++) {
+		h=(h^data[i])*16777619u;
+	}
+	return h;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0]=v;
+	p[1]=v>>8;
+	p[2]=v>>16;
+	p[3]=v>>24;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0]|(p[1]<<8)|(p[2]<<16)|((uint32_t)p[3]<<24);
+}
+
+static int read_full(int fd, uint8_t *buf, size_t len, off_t ofs)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n=pread(fd, buf, len, ofs)) <= 0) {
+			if ((n < 0) && (errno == EINTR)) {
+				continue;
+			}
+			return -1;
+		}
+		buf+=n;
+		len-=n;
+		ofs+=n;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const uint8_t *buf, size_t len, off_t ofs)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n=pwrite(fd, buf, len, ofs)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf+=n;
+		len-=n;
+		ofs+=n;
+	}
+	return 0;
+}
+
+static long now_ms(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec*1000L+t.tv_nsec/1000000;
+}
+
+static int spool_state(pt_spool s, off_t ofs, uint8_t state)
+{
+	if (write_full(s->fd, &state, 1, ofs+2) != 0) {
+		fprintf(stderr, _("could not write spool: %s\n"), strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* find the first unfinished job and the end of the complete records */
+static int spool_scan(pt_spool s)
+{
+	uint8_t hdr[SPOOL_HEADER], *data=NULL, *p;
+	size_t alloc=0, len;
+	off_t ofs=0;
+
+	s->next=-1;
+	while (read_full(s->fd, hdr, SPOOL_HEADER, ofs) == 0) {
+		if (memcmp(hdr, "PJ", 2) != 0) {
+			break;
+		}
+		len=get_le32(hdr+4);
+		if (len > alloc) {
+			if ((p=realloc(data, len)) == NULL) {
+				free(data);
+				return -1;
+			}
+			data=p;
+			alloc=len;
+		}
+		if ((read_full(s->fd, data, len, ofs+SPOOL_HEADER) != 0) ||
+		    (fnv1a(data, len) != get_le32(hdr+8))) {
+			break;
+		}
+		s->jobs++;
+		if (hdr[2] != SPOOL_DONE) {
+			if (s->next < 0) {
+				s->next=ofs;
+			}
+			if (hdr[2] == SPOOL_SENDING) {
+				printf(_("spooled job %i was interrupted, printing it again\n"), s->jobs);
+			}
+			s->pending++;
+		}
+		ofs+=SPOOL_HEADER+len;
+	}
+	free(data);
+	s->end=ofs;
+	if (s->next < 0) {
+		s->next=ofs;
+	}
+	/* drop a record that was only partly written */
+	if (ftruncate(s->fd, s->end) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+pt_spool pt_spool_open(const char *dir)
+{
+	pt_spool s;
+	char file[4096];
+
+	if ((mkdir(dir, 0700) != 0) && (errno != EEXIST)) {
+		printf(_("could not create spool directory '%s': %s\n"), dir, strerror(errno));
+		return NULL;
+	}
+	if ((s=malloc(sizeof(struct _pt_spool))) == NULL) {
+		return NULL;
+	}
+	memset(s, 0, sizeof(struct _pt_spool));
+	snprintf(file, sizeof(file), "%s/spool", dir);
+	if ((s->fd=open(file, O_RDWR|O_CREAT, 0600)) < 0) {
+		printf(_("could not open spool '%s': %s\n"), file, strerror(errno));
+		free(s);
+		return NULL;
+	}
+	if (flock(s->fd, LOCK_EX|LOCK_NB) != 0) {
+		printf(_("spool '%s' is in use\n"), file);
+		close(s->fd);
+		free(s);
+		return NULL;
+	}
+	if ((spool_scan(s) != 0) || ((s->wbuf=ptouch_buf_new()) == NULL)) {
+		printf(_("could not read spool '%s'\n"), file);
+		close(s->fd);
+		free(s);
+		return NULL;
+	}
+	if (s->pending > 0) {
+		printf(_("resuming %i of %i spooled jobs\n"), s->pending, s->jobs);
+	}
+	return s;
+}
+
+static int spool_flush(pt_spool s)
+{
+	if (s->wbuf->len == 0) {
+		return 0;
+	}
+	if (write_full(s->fd, s->wbuf->data, s->wbuf->len, s->end) != 0) {
+		fprintf(stderr, _("could not write spool: %s\n"), strerror(errno));
+		return -1;
+	}
+	s->end+=s->wbuf->len;
+	s->wbuf->len=0;
+	return 0;
+}
+
+int pt_spool_sync(pt_spool s)
+{
+	if (spool_flush(s) != 0) {
+		return -1;
+	}
+	if (fdatasync(s->fd) != 0) {
+		fprintf(stderr, _("could not sync spool: %s\n"), strerror(errno));
+		return -1;
+	}
+	s->unsynced=0;
+	return 0;
+}
+
+/* queue the commands in b as a new job */
+int pt_spool_add(pt_spool s, ptouch_buf b, int tape_width)
+{
+	uint8_t hdr[SPOOL_HEADER]={'P', 'J', SPOOL_QUEUED};
+
+	hdr[3]=tape_width;
+	put_le32(hdr+4, b->len);
+	put_le32(hdr+8, fnv1a(b->data, b->len));
+	put_le32(hdr+12, b->lines);
+	put_le32(hdr+16, b->labels);
+	if ((ptouch_buf_add(s->wbuf, hdr, SPOOL_HEADER) != 0) ||
+	    (ptouch_buf_add(s->wbuf, b->data, b->len) != 0)) {
+		return -1;
+	}
+	s->jobs++;
+	s->pending++;
+	if ((s->wbuf->len >= SPOOL_WRITE_BUF) && (spool_flush(s) != 0)) {
+		return -1;
+	}
+	if (++s->unsynced >= SPOOL_SYNC_JOBS) {
+		return pt_spool_sync(s);
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Send all jobs that are not done yet, in the order they were added.
+	The caller has to send ptouch_rasterstart() before, eject the tape
+	afterwards and then call pt_spool_done(). Until then the jobs stay
+	marked SPOOL_SENDING.
+   -------------------------------------------------------------------- */
+int pt_spool_run(pt_spool s, ptouch_dev ptdev)
+{
+	uint8_t hdr[SPOOL_HEADER];
+	struct _ptouch_buf b={NULL, 0, 0, 0, 0};
+	off_t ofs;
+	size_t len;
+	uint8_t *p;
+	long synced=now_ms();
+	int r=0;
+
+	if (pt_spool_sync(s) != 0) {
+		return -1;
+	}
+	for (ofs=s->next; (r == 0) && (ofs < s->end); ofs+=SPOOL_HEADER+len) {
+		if (read_full(s->fd, hdr, SPOOL_HEADER, ofs) != 0) {
+			r=-1;
+			break;
+		}
+		len=get_le32(hdr+4);
+		if (hdr[2] == SPOOL_DONE) {
+			continue;
+		}
+		if (hdr[3] != ptouch_getmaxwidth(ptdev)) {
+			printf(_("spooled job is for a %ipx tape, but the tape is %ipx\n"),
+				hdr[3], ptouch_getmaxwidth(ptdev));
+			r=-1;
+			break;
+		}
+		if (len > b.alloc) {
+			if ((p=realloc(b.data, len)) == NULL) {
+				r=-1;
+				break;
+			}
+			b.data=p;
+			b.alloc=len;
+		}
+		b.len=len;
+		b.lines=get_le32(hdr+12);
+		b.labels=get_le32(hdr+16);
+		if (read_full(s->fd, b.data, len, ofs+SPOOL_HEADER) != 0) {
+			r=-1;
+			break;
+		}
+		if (spool_state(s, ofs, SPOOL_SENDING) != 0) {
+			r=-1;
+			break;
+		}
+		if (now_ms()-synced >= SPOOL_SYNC_MS) {
+			if (fdatasync(s->fd) != 0) {
+				r=-1;
+				break;
+			}
+			synced=now_ms();
+		}
+		if (ptouch_buf_send(ptdev, &b) != 0) {
+			printf(_("ptouch_send() failed\n"));
+			r=-1;
+			break;
+		}
+		s->sent=ofs+SPOOL_HEADER+len;
+	}
+	free(b.data);
+	return r;
+}
+
+/* mark the jobs sent by pt_spool_run() as done, after the tape with
+   them was ejected */
+int pt_spool_done(pt_spool s)
+{
+	uint8_t hdr[SPOOL_HEADER];
+	off_t ofs;
+
+	if (s->sent <= s->next) {	/* nothing was sent */
+		return 0;
+	}
+	for (ofs=s->next; ofs < s->sent; ofs+=SPOOL_HEADER+get_le32(hdr+4)) {
+		if (read_full(s->fd, hdr, SPOOL_HEADER, ofs) != 0) {
+			return -1;
+		}
+		if (hdr[2] == SPOOL_DONE) {
+			continue;
+		}
+		if (spool_state(s, ofs, SPOOL_DONE) != 0) {
+			return -1;
+		}
+		s->pending--;
+	}
+	s->next=s->sent;
+	if (fdatasync(s->fd) != 0) {
+		fprintf(stderr, _("could not sync spool: %s\n"), strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* ok is 0 if printing failed, the spool is then kept as it is */
+void pt_spool_close(pt_spool s, int ok)
+{
+	if (s == NULL) {
+		return;
+	}
+	if (ok && (s->pending == 0) && (s->wbuf->len == 0)) {
+		if (ftruncate(s->fd, 0) != 0) {
+			fprintf(stderr, _("could not truncate spool: %s\n"), strerror(errno));
+		}
+	} else {
+		pt_spool_sync(s);
+	}
+	fsync(s->fd);
+	close(s->fd);
+	ptouch_buf_free(s->wbuf);
+	free(s);
+}
@@ -0,0 +1,364 @@
+/*
+	ptouch-template - labels with static content and variable fields
+
+	Copyright (C) 2015 Dominic Radermacher <dominic.radermacher@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* --------------------------------------------------------------------
+	A template file has one item per line, empty lines and lines
+	starting with # are ignored. Coordinates are in px, x counts
+	columns from the start of the label and y rows from the top edge.
+
+	length <columns>			minimum label length
+	counter <start> <step> <digits>		setup for {counter}
+	text <x> <baseline> <size> <text>	static text
+	image <x> <y> <file>			static 2 color png
+	line <x1> <y1> <x2> <y2>		static line
+	field <x> <baseline> <size> <width> <format>
+						variable text, clipped to
+						<width> columns
+
+	In a field format {counter} is replaced by the label counter,
+	{date} by the current date and {1} to {9} by the columns of the
+	data given for the label.
+   -------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>	/* malloc(), strtol() */
+#include <string.h>	/* memcpy(), strcmp() */
+#include <ctype.h>	/* isspace(), isdigit() */
+#include <time.h>	/* time(), strftime() */
+#include <gd.h>
+#include "config.h"
+#include "gettext.h"	/* gettext(), ngettext() */
+#include "ptouch.h"
+#include "ptouch-render.h"
+#include "ptouch-template.h"
+
+#define _(s) gettext(s)
+
+/* make sure the label is at least width columns long */
+static int template_reserve(pt_template t, int width)
+{
+	if (width > t->bg->width) {
+		return pt_label_resize(t->bg, width);
+	}
+	return 0;
+}
+
+static int template_text(pt_template t, int x, int baseline, int size, char *text)
+{
+	int width;
+
+	if (pt_text_extent(t->ctx, t->font, size, text, &width, NULL, NULL) != 0) {
+		return -1;
+	}
+	if (template_reserve(t, x+width) != 0) {
+		return -1;
+	}
+	return pt_text_draw(t->ctx, t->bg, t->font, size, x, baseline, text);
+}
+
+static int template_image(pt_template t, int x, int y, char *file)
+{
+	gdImage *im=NULL;
+	FILE *f;
+	int d, i, k;
+
+	if ((f=fopen(file, "rb")) != NULL) {
+		im=gdImageCreateFromPng(f);
+		fclose(f);
+	}
+	if (im == NULL) {
+		printf(_("could not load image '%s'\n"), file);
+		return -1;
+	}
+	if (template_reserve(t, x+gdImageSX(im)) != 0) {
+		gdImageDestroy(im);
+		return -1;
+	}
+	/* find out whether color 0 or color 1 is darker */
+	d=(gdImageRed(im,1)+gdImageGreen(im,1)+gdImageBlue(im,1) < gdImageRed(im,0)+gdImageGreen(im,0)+gdImageBlue(im,0))?1:0;
+	for (k=0; k<gdImageSX(im); k++) {
+		for (i=0; i<gdImageSY(im); i++) {
+			if (gdImageGetPixel(im, k, i) == d) {
+				pt_label_setpixel(t->bg, x+k, y+i);
+			}
+		}
+	}
+	gdImageDestroy(im);
+	return 0;
+}
+
+static int template_line(pt_template t, int x1, int y1, int x2, int y2)
+{
+	int dx=abs(x2-x1), dy=-abs(y2-y1);
+	int sx=(x1 < x2)?1:-1, sy=(y1 < y2)?1:-1;
+	int err=dx+dy, e2;
+
+	if ((x1 < 0) || (x2 < 0)) {
+		return -1;
+	}
+	if (template_reserve(t, ((x1 > x2)?x1:x2)+1) != 0) {
+		return -1;
+	}
+	for (;;) {		/* Bresenham */
+		pt_label_setpixel(t->bg, x1, y1);
+		if ((x1 == x2) && (y1 == y2)) {
+			break;
+		}
+		e2=2*err;
+		if (e2 >= dy) {
+			err+=dy;
+			x1+=sx;
+		}
+		if (e2 <= dx) {
+			err+=dx;
+			y1+=sy;
+		}
+	}
+	return 0;
+}
+
+static int template_field(pt_template t, int x, int baseline, int size, int width, char *format)
+{
+	struct _pt_field *f;
+
+	if ((x < 0) || (width <= 0) || (size <= 0)) {
+		return -1;
+	}
+	if ((f=realloc(t->field, (t->fields+1)*sizeof(struct _pt_field))) == NULL) {
+		return -1;
+	}
+	t->field=f;
+	f=&t->field[t->fields];
+	f->x=x;
+	f->width=width;
+	f->baseline=baseline;
+	f->size=size;
+	f->value[0]='\0';
+	f->format=strdup(format);
+	f->img=pt_label_new(t->bg->height, width);
+	if ((f->format == NULL) || (f->img == NULL)) {
+		free(f->format);
+		pt_label_free(f->img);
+		return -1;
+	}
+	t->fields++;
+	return template_reserve(t, x+width);
+}
+
+/* the rest of a line after n numbers, without trailing newline */
+static char *rest_of_line(char *p, int skip)
+{
+	p+=skip;
+	while (isspace((unsigned char)*p)) {
+		p++;
+	}
+	p[strcspn(p, "\r\n")]='\0';
+	return p;
+}
+
+pt_template pt_template_load(ptouch_ctx ctx, const char *file, int tape_width)
+{
+	pt_template t;
+	char line[1024], *p;
+	int a, b, c, d, n, r, nr=0;
+	FILE *f;
+
+	if ((f=fopen(file, "r")) == NULL) {
+		printf(_("could not open template '%s'\n"), file);
+		return NULL;
+	}
+	if ((t=malloc(sizeof(struct _pt_template))) == NULL) {
+		fclose(f);
+		return NULL;
+	}
+	memset(t, 0, sizeof(struct _pt_template));
+	t->ctx=ctx;
+	t->font=strdup(ptouch_ctx_font(ctx));
+	t->step=1;
+	if ((t->font == NULL) || ((t->bg=pt_label_new(tape_width, 0)) == NULL)) {
+		fclose(f);
+		pt_template_free(t);
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		nr++;
+		for (p=line; isspace((unsigned char)*p); p++) {
+			;
+		}
+		if ((*p == '\0') || (*p == '#')) {
+			continue;
+		}
+		r=-1;
+		n=0;
+		if (strncmp(p, "length", 6) == 0) {
+			if (sscanf(p+6, "%d", &a) == 1) {
+				r=template_reserve(t, a);
+			}
+		} else if (strncmp(p, "counter", 7) == 0) {
+			if (sscanf(p+7, "%ld %ld %d", &t->counter, &t->step, &t->digits) == 3) {
+				r=0;
+			}
+		} else if (strncmp(p, "text", 4) == 0) {
+			if (sscanf(p+4, "%d %d %d%n", &a, &b, &c, &n) == 3) {
+				r=template_text(t, a, b, c, rest_of_line(p+4, n));
+			}
+		} else if (strncmp(p, "image", 5) == 0) {
+			if (sscanf(p+5, "%d %d%n", &a, &b, &n) == 2) {
+				r=template_image(t, a, b, rest_of_line(p+5, n));
+			}
+		} else if (strncmp(p, "line", 4) == 0) {
+			if (sscanf(p+4, "%d %d %d %d", &a, &b, &c, &d) == 4) {
+				r=template_line(t, a, b, c, d);
+			}
+		} else if (strncmp(p, "field", 5) == 0) {
+			if (sscanf(p+5, "%d %d %d %d%n", &a, &b, &c, &d, &n) == 4) {
+				r=template_field(t, a, b, c, d, rest_of_line(p+5, n));
+			}
+		}
+		if (r != 0) {
+			printf(_("error in template '%s' line %i\n"), file, nr);
+			fclose(f);
+			pt_template_free(t);
+			return NULL;
+		}
+	}
+	fclose(f);
+	if (((t->label=pt_label_new(tape_width, t->bg->width)) == NULL) ||
+	    ((t->buf=ptouch_buf_new()) == NULL)) {
+		pt_template_free(t);
+		return NULL;
+	}
+	t->buf->labels=1;	/* always holds the current label */
+	return t;
+}
+
+static void field_expand(pt_template t, struct _pt_field *f, const char *date,
+	char *data[], int cols, char *out)
+{
+	char *p=f->format, *e, tmp[32];
+	const char *s;
+	size_t n=0, len;
+	int col;
+
+	while ((*p != '\0') && (n+1 < TEMPLATE_VALUE_LEN)) {
+		s=NULL;
+		if ((*p == '{') && ((e=strchr(p, '}')) != NULL)) {
+			len=e-p-1;
+			if ((len == 7) && (strncmp(p+1, "counter", 7) == 0)) {
+				snprintf(tmp, sizeof(tmp), "%0*ld", t->digits, t->counter);
+				s=tmp;
+			} else if ((len == 4) && (strncmp(p+1, "date", 4) == 0)) {
+				s=date;
+			} else if ((len == 1) && isdigit((unsigned char)p[1]) && (p[1] != '0')) {
+				col=p[1]-'1';
+				s=(col < cols)?data[col]:"";
+			}
+			if (s != NULL) {
+				len=strlen(s);
+				if (n+len >= TEMPLATE_VALUE_LEN) {
+					len=TEMPLATE_VALUE_LEN-1-n;
+				}
+				memcpy(out+n, s, len);
+				n+=len;
+				p=e+1;
+				continue;
+			}
+		}
+		out[n++]=*p++;
+	}
+	out[n]='\0';
+}
+
+/* background plus all fields covering a column */
+static void template_compose(pt_template t, int x)
+{
+	uint8_t *dst=pt_label_column(t->label, x), *src;
+	struct _pt_field *f;
+
+	memcpy(dst, pt_label_column(t->bg, x), PT_RASTER_BYTES);
+	for (f=t->field; f < t->field+t->fields; f++) {
+		if ((x >= f->x) && (x < f->x+f->width)) {
+			src=pt_label_column(f->img, x-f->x);
+			for (int i=0; i<PT_RASTER_BYTES; i++) {
+				dst[i] |= src[i];
+			}
+		}
+	}
+}
+
+/* --------------------------------------------------------------------
+	Render the next label. data are the data columns for this label.
+	Afterwards t->label holds the label and t->buf the raster lines
+	for it, only changed fields have been rendered and encoded again.
+   -------------------------------------------------------------------- */
+int pt_template_next(pt_template t, char *data[], int cols)
+{
+	char value[TEMPLATE_VALUE_LEN], date[32];
+	struct _pt_field *f;
+	time_t now=time(NULL);
+	int x;
+
+	strftime(date, sizeof(date), "%Y-%m-%d", localtime(&now));
+	for (f=t->field; f < t->field+t->fields; f++) {
+		field_expand(t, f, date, data, cols, value);
+		if ((t->rendered > 0) && (strcmp(value, f->value) == 0)) {
+			continue;
+		}
+		strcpy(f->value, value);
+		memset(f->img->raster, 0, (size_t)f->width*PT_RASTER_BYTES);
+		if (pt_text_draw(t->ctx, f->img, t->font, f->size, 0, f->baseline, value) != 0) {
+			return -1;
+		}
+		if (t->rendered == 0) {
+			continue;		/* everything is encoded below */
+		}
+		for (x=f->x; x<f->x+f->width; x++) {
+			template_compose(t, x);
+			memcpy(t->buf->data+x*(PT_RASTER_BYTES+3)+3, pt_label_column(t->label, x), PT_RASTER_BYTES);
+		}
+	}
+	if (t->rendered == 0) {
+		for (x=0; x<t->label->width; x++) {
+			template_compose(t, x);
+		}
+		if (ptouch_buf_raster(t->buf, t->label->raster, t->label->width, PT_RASTER_BYTES) != 0) {
+			return -1;
+		}
+	}
+	t->counter+=t->step;
+	t->rendered++;
+	return 0;
+}
+
+void pt_template_free(pt_template t)
+{
+	if (t == NULL) {
+		return;
+	}
+	for (int i=0; i<t->fields; i++) {
+		free(t->field[i].format);
+		pt_label_free(t->field[i].img);
+	}
+	free(t->field);
+	free(t->font);
+	pt_label_free(t->bg);
+	pt_label_free(t->label);
+	ptouch_buf_free(t->buf);
+	free(t);
+}
@@ -0,0 +1,170 @@
+/*
+	ptouch-threadtest - render and print labels from two threads at once
+
+	Copyright (C) 2015 Dominic Radermacher <dominic.radermacher@gmail.com>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+/* Two threads, each with a context of its own, render the same labels
+   over and over and print them with the job API into /dev/null. Every
+   label has to come out exactly like the one rendered before the
+   threads were started. Run by "make check", with a font cache of
+   its own in a temporary XDG_CACHE_HOME. */
+
+#define _GNU_SOURCE	/* mkdtemp() */
+#include <stdio.h>	/* printf(), snprintf() */
+#include <stdlib.h>	/* setenv() */
+#include <string.h>	/* memcmp() */
+#include <unistd.h>	/* unlink(), rmdir() */
+#include <pthread.h>
+#include "ptouch.h"
+#include "ptouch-render.h"
+#include "ptouch-job.h"
+
+#define THREADS 2
+#define ROUNDS 100
+#define CLEANUP 25	/* drop the font caches every CLEANUP rounds */
+#define TAPE_MM 12
+#define SKIP 77		/* automake: the test was skipped */
+
+static const char *fonts[]={ NULL, "builtin:5x7" };	/* NULL: ctx default */
+#define FONTS (sizeof(fonts)/sizeof(fonts[0]))
+static char *text[]={ "Hello World", "0123456789 gjpqy" };
+#define LINES (sizeof(text)/sizeof(text[0]))
+
+static pt_label ref[FONTS];
+static int tape_width;
+
+static pt_label render(ptouch_ctx ctx, int font)
+{
+	int size=0;
+
+	return pt_render_text(ctx, (fonts[font] != NULL) ? fonts[font] : ptouch_ctx_font(ctx),
+		&size, text, LINES, tape_width);
+}
+
+static int same(pt_label a, pt_label b)
+{
+	return (a->width == b->width) && (a->height == b->height) &&
+		(memcmp(a->raster, b->raster, a->width*PT_RASTER_BYTES) == 0);
+}
+
+static void *run(void *arg)
+{
+	ptouch_ctx ctx;
+	ptouch_dev dev;
+	ptouch_job job;
+	pt_label l;
+	long failed=0;
+	int i, f;
+
+	if ((ctx=ptouch_ctx_new()) == NULL) {
+		return (void *)1L;
+	}
+	if (ptouch_open_file(ctx, &dev, "/dev/null", TAPE_MM) != 0) {
+		ptouch_ctx_free(ctx);
+		return (void *)1L;
+	}
+	for (i=0; i<ROUNDS; i++) {
+		for (f=0; f<(int)FONTS; f++) {
+			if ((l=render(ctx, f)) == NULL) {
+				failed++;
+				continue;
+			}
+			if (!same(l, ref[f])) {
+				failed++;
+			}
+			pt_label_free(l);
+		}
+		if ((job=ptouch_job_new(ctx)) == NULL) {
+			failed++;
+			continue;
+		}
+		if ((ptouch_job_add_text(job, "Hello World") != 0) ||
+		    (ptouch_job_add_cutmark(job) != 0) ||
+		    (ptouch_job_submit(job, dev) != 0) ||
+		    (ptouch_job_wait(job) != 0)) {
+			failed++;
+		}
+		ptouch_job_free(job);
+		if ((i % CLEANUP) == CLEANUP-1) {
+			pt_font_cleanup(ctx);
+		}
+	}
+	ptouch_close(dev);
+	ptouch_ctx_free(ctx);
+	return (void *)failed;
+}
+
+static int test(void)
+{
+	ptouch_ctx ctx;
+	pthread_t t[THREADS];
+	void *failed;
+	long total=0;
+	int i, f;
+
+	if ((tape_width=ptouch_tape_px(TAPE_MM)) <= 0) {
+		return 1;
+	}
+	if ((ctx=ptouch_ctx_new()) == NULL) {
+		return 1;
+	}
+	for (f=0; f<(int)FONTS; f++) {
+		if ((ref[f]=render(ctx, f)) == NULL) {
+			printf("could not render with font '%s', skipping\n",
+				(fonts[f] != NULL) ? fonts[f] : ptouch_ctx_font(ctx));
+			return SKIP;
+		}
+	}
+	for (i=0; i<THREADS; i++) {
+		if (pthread_create(&t[i], NULL, run, NULL) != 0) {
+			printf("pthread_create() failed\n");
+			return 1;
+		}
+	}
+	for (i=0; i<THREADS; i++) {
+		pthread_join(t[i], &failed);
+		total+=(long)failed;
+	}
+	for (f=0; f<(int)FONTS; f++) {
+		pt_label_free(ref[f]);
+	}
+	ptouch_ctx_free(ctx);
+	if (total > 0) {
+		printf("%ld of %d labels were wrong\n", total, THREADS*ROUNDS*(int)(FONTS+1));
+		return 1;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	char dir[]="/tmp/ptouch-threadtest.XXXXXX", file[64];
+	int r;
+
+	/* keep the font cache out of the real ~/.cache */
+	if ((mkdtemp(dir) == NULL) || (setenv("XDG_CACHE_HOME", dir, 1) != 0)) {
+		printf("could not create a cache directory\n");
+		return 1;
+	}
+	r=test();
+	snprintf(file, sizeof(file), "%s/ptouch/fonts", dir);
+	unlink(file);
+	snprintf(file, sizeof(file), "%s/ptouch", dir);
+	rmdir(file);
+	rmdir(dir);
+	return r;
+}